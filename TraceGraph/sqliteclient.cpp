@@ -21,11 +21,42 @@
 /* along with this program.  If not, see <http://www.gnu.org/licenses/>. */
 /* ===================================================================== */
 #include "sqliteclient.h"
+#include <QByteArray>
+#include <stdlib.h>
+
+// Address columns are INTEGER since schema v2, hex TEXT before
+static unsigned long long columnAddress(sqlite3_stmt *query, int i)
+{
+    if(sqlite3_column_type(query, i) == SQLITE_INTEGER)
+        return (unsigned long long) sqlite3_column_int64(query, i);
+    return strtoull((const char*) sqlite3_column_text(query, i), NULL, 16);
+}
+
+// Byte columns are BLOB since schema v2, hex TEXT before
+static QByteArray columnHex(sqlite3_stmt *query, int i)
+{
+    if(sqlite3_column_type(query, i) == SQLITE_BLOB)
+        return QByteArray((const char*) sqlite3_column_blob(query, i), sqlite3_column_bytes(query, i)).toHex();
+    return QByteArray((const char*) sqlite3_column_text(query, i));
+}
+
+// Column as shown in the event descriptions, formatted like schema v1 did
+static QString columnDescription(sqlite3_stmt *query, int i)
+{
+    const char *name = sqlite3_column_name(query, i);
+    if(sqlite3_column_type(query, i) == SQLITE_BLOB)
+        return QString(columnHex(query, i));
+    if(sqlite3_column_type(query, i) == SQLITE_INTEGER &&
+       (strcmp(name, "ip") == 0 || strcmp(name, "addr") == 0))
+        return QString("0x%1").arg(columnAddress(query, i), 16, 16, QLatin1Char('0'));
+    return QString((const char*) sqlite3_column_text(query, i));
+}
 
 SqliteClient::SqliteClient(QObject *parent) :
     QObject(parent)
 {
     db = NULL;
+    schema_version = 1;
 }
 
 SqliteClient::~SqliteClient()
@@ -41,6 +72,19 @@ void SqliteClient::connectToDatabase(QString filename)
 
         sqlite3_prepare_v2(db, "SELECT value FROM info where key=?;", -1, &key_query, NULL);
 
+        // Databases without the key predate the versioning
+        schema_version = 1;
+        sqlite3_bind_text(key_query, 1, "SCHEMA_VERSION", -1, SQLITE_TRANSIENT);
+        if(sqlite3_step(key_query) == SQLITE_ROW)
+            schema_version = sqlite3_column_int(key_query, 0);
+        sqlite3_reset(key_query);
+        if(schema_version < 1 || schema_version > 3) {
+            sqlite3_finalize(key_query);
+            cleanup();
+            emit invalidDatabase();
+            return;
+        }
+
         sqlite3_bind_text(key_query, 1, "TRACERGRIND_VERSION", -1, SQLITE_TRANSIENT);
         if(sqlite3_step(key_query) == SQLITE_ROW) {
             emit connectedToDatabase();
@@ -173,7 +217,12 @@ void SqliteClient::queryEvents()
     sqlite3_stmt *ins_query, *mem_query;
 
 
-    sqlite3_prepare_v2(db, "SELECT rowid, ip, op FROM ins;", -1, &ins_query, NULL);
+    // Since v3 the static part of the instructions lives in code. CROSS JOIN
+    // keeps ins as the outer loop, so rows come in execution order.
+    if(schema_version >= 3)
+        sqlite3_prepare_v2(db, "SELECT ins.rowid, code.ip, code.op FROM ins CROSS JOIN code ON code.rowid = ins.code_id;", -1, &ins_query, NULL);
+    else
+        sqlite3_prepare_v2(db, "SELECT rowid, ip, op FROM ins;", -1, &ins_query, NULL);
     sqlite3_prepare_v2(db, "SELECT rowid, ins_id, type, addr, size FROM mem;", -1, &mem_query, NULL);
     sqlite3_step(mem_query);
 
@@ -183,8 +232,11 @@ void SqliteClient::queryEvents()
         ins_ev.type = EVENT_INS;
         ins_ev.id[0] = sqlite3_column_int64(ins_query, 0);
         ins_ev.nbID = 1;
-        ins_ev.address = strtoul((const char*) sqlite3_column_text(ins_query, 1), NULL, 16);
-        ins_ev.size = strlen((const char*) sqlite3_column_text(ins_query, 2))/2;
+        ins_ev.address = columnAddress(ins_query, 1);
+        if(schema_version >= 2)
+            ins_ev.size = sqlite3_column_bytes(ins_query, 2);
+        else
+            ins_ev.size = strlen((const char*) sqlite3_column_text(ins_query, 2))/2;
         ins_ev.time = time;
 
         sqlite3_bind_int64(mem_query, 1, ins_ev.id[0]);
@@ -200,7 +252,7 @@ void SqliteClient::queryEvents()
                 mem_ev.type = EVENT_W;
             else
                 mem_ev.type = EVENT_UFO;
-            mem_ev.address = strtoul((const char*) sqlite3_column_text(mem_query, 3), NULL, 16);
+            mem_ev.address = columnAddress(mem_query, 3);
             mem_ev.size = sqlite3_column_int(mem_query, 4);
             mem_ev.time = time;
 
@@ -221,7 +273,11 @@ QString SqliteClient::queryInstDescription(unsigned long long id)
 {
     QString description;
     sqlite3_stmt *query;
-    sqlite3_prepare_v2(db, "SELECT * from INS where rowid=?;", -1, &query, NULL);
+    if(schema_version >= 3)
+        sqlite3_prepare_v2(db, "SELECT ins.bbl_id AS bbl_id, code.ip AS ip, code.dis AS dis, code.op AS op "
+                               "FROM ins CROSS JOIN code ON code.rowid = ins.code_id WHERE ins.rowid=?;", -1, &query, NULL);
+    else
+        sqlite3_prepare_v2(db, "SELECT * from INS where rowid=?;", -1, &query, NULL);
 
     sqlite3_bind_int64(query, 1, id);
     if(sqlite3_step(query) == SQLITE_ROW)
@@ -232,7 +288,7 @@ QString SqliteClient::queryInstDescription(unsigned long long id)
         {
             description.append(sqlite3_column_name(query, i));
             description.append(": ");
-            description.append((const char*)sqlite3_column_text(query, i));
+            description.append(columnDescription(query, i));
             description.append("\n");
         }
         description.append("\n");
@@ -273,7 +329,10 @@ void SqliteClient::queryEventDescription(Event ev)
     for (evN = 0; evN < ev.nbID; evN++)
     {
         sqlite3_stmt *query;
-        sqlite3_prepare_v2(db, "SELECT ins_id, type, addr, addr_end, size, data, value from mem where rowid=?;", -1, &query, NULL);
+        if(schema_version >= 2)
+            sqlite3_prepare_v2(db, "SELECT ins_id, type, addr, size, data from mem where rowid=?;", -1, &query, NULL);
+        else
+            sqlite3_prepare_v2(db, "SELECT ins_id, type, addr, addr_end, size, data, value from mem where rowid=?;", -1, &query, NULL);
         sqlite3_bind_int64(query, 1, ev.id[evN]);
         if(sqlite3_step(query) == SQLITE_ROW)
         {
@@ -287,7 +346,7 @@ void SqliteClient::queryEventDescription(Event ev)
             {
                 description.append(sqlite3_column_name(query, i));
                 description.append(": ");
-                description.append((const char*)sqlite3_column_text(query, i));
+                description.append(columnDescription(query, i));
                 description.append("\n");
             }
             description.append("\n");
@@ -319,7 +378,7 @@ void SqliteClient::queryMemoryDumpDescription(Event ev)
 
     while (missing != 0 && sqlite3_step(query) == SQLITE_ROW)
     {
-        unsigned long long address = strtoul((const char*) sqlite3_column_text(query, 2), NULL, 16);
+        unsigned long long address = columnAddress(query, 2);
         unsigned long size = sqlite3_column_int(query, 3);
 
         if (address + size <= ev.address || ev.address + ev.size <= address)
@@ -328,8 +387,9 @@ void SqliteClient::queryMemoryDumpDescription(Event ev)
         }
 
         unsigned long long position = (address<ev.address) ? ev.address : address;
-        const char* data = (const char*) sqlite3_column_text(query, 4);
-        unsigned int lendata = strlen(data);
+        QByteArray hexdata = columnHex(query, 4);
+        const char* data = hexdata.constData();
+        unsigned int lendata = hexdata.size();
         while (position < address + size && position < ev.address + ev.size) {
             unsigned int positionBuff = (position - ev.address) * 2;
             unsigned int positionData = (position - address) * 2;
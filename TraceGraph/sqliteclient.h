@@ -79,6 +79,9 @@ public slots:
 
 private:
     sqlite3 *db;
+    // 1: addresses and bytes stored as hex TEXT, 2: INTEGER and BLOB,
+    // 3: ins references its static instruction in code
+    int schema_version;
 
     QString queryInstDescription(unsigned long long id);
     void queryMemoryDumpDescription(Event ev);
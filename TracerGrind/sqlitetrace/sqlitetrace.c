@@ -31,14 +31,128 @@
 
 #define BUFFER_SIZE 2048
 
+// Schema v2: addresses are INTEGER and raw bytes BLOB, the version is
+// recorded under SCHEMA_VERSION in info (v1 had no such key)
+// Schema v3: the static part of the instructions (ip, dis, op) is stored
+// once in code, ins rows only reference it
+#define SCHEMA_VERSION "3"
 static const char *SETUP_QUERY = 
 "CREATE TABLE IF NOT EXISTS info (key TEXT PRIMARY KEY, value TEXT);\n"
-"CREATE TABLE IF NOT EXISTS lib (name TEXT, base TEXT, end TEXT);\n"
-"CREATE TABLE IF NOT EXISTS bbl (addr TEXT, addr_end TEXT, size INTEGER, thread_id INTEGER);\n"
-"CREATE TABLE IF NOT EXISTS ins (bbl_id INTEGER, ip TEXT, dis TEXT, op TEXT);\n"
-"CREATE TABLE IF NOT EXISTS mem (ins_id INTEGER, ip TEXT, type TEXT, addr TEXT, addr_end TEXT, size INTEGER, data TEXT, value TEXT);\n"
+"CREATE TABLE IF NOT EXISTS lib (name TEXT, base INTEGER, end INTEGER);\n"
+"CREATE TABLE IF NOT EXISTS bbl (addr INTEGER, size INTEGER, thread_id INTEGER);\n"
+"CREATE TABLE IF NOT EXISTS code (ip INTEGER, dis TEXT, op BLOB);\n"
+"CREATE TABLE IF NOT EXISTS ins (bbl_id INTEGER, code_id INTEGER);\n"
+"CREATE TABLE IF NOT EXISTS mem (ins_id INTEGER, type TEXT, addr INTEGER, size INTEGER, data BLOB);\n"
 "CREATE TABLE IF NOT EXISTS thread (thread_id INTEGER, start_bbl_id INTEGER, exit_bbl_id INTEGER);\n";
 
+// Instructions already stored in code, keyed by address and bytes
+// (open addressing, at most half full)
+typedef struct
+{
+    uint64_t address;
+    sqlite3_int64 code_id; // 0 for a free slot
+    uint8_t size;
+    uint8_t bytes[24];
+} CodeEntry;
+
+CodeEntry *code_table = NULL;
+size_t code_table_size = 0, code_table_used = 0;
+
+uint64_t code_hash(uint64_t address, const uint8_t *bytes, uint8_t size)
+{
+    uint64_t h = 14695981039346656037ULL ^ address;
+    int i;
+    for(i = 0; i < size; i++)
+        h = (h ^ bytes[i]) * 1099511628211ULL;
+    return h ^ (h >> 29);
+}
+
+CodeEntry* code_lookup(uint64_t address, const uint8_t *bytes, uint8_t size)
+{
+    size_t i = code_hash(address, bytes, size) & (code_table_size - 1);
+    while(code_table[i].code_id != 0 &&
+          (code_table[i].address != address || code_table[i].size != size ||
+           memcmp(code_table[i].bytes, bytes, size) != 0))
+        i = (i + 1) & (code_table_size - 1);
+    return &code_table[i];
+}
+
+void code_grow()
+{
+    CodeEntry *old = code_table;
+    size_t i, old_size = code_table_size;
+    code_table_size = old_size ? 2 * old_size : 4096;
+    code_table = (CodeEntry*) calloc(code_table_size, sizeof(CodeEntry));
+    for(i = 0; i < old_size; i++)
+        if(old[i].code_id != 0)
+            *code_lookup(old[i].address, old[i].bytes, old[i].size) = old[i];
+    free(old);
+}
+
+// Block definitions of protocol 3, indexed by ID. They are disassembled and
+// stored in code once, their executions only insert ins rows.
+typedef struct
+{
+    uint64_t number;
+    uint64_t *addresses;
+    uint8_t *lengths;
+    sqlite3_int64 *code_ids;
+} Block;
+
+Block *blocks = NULL;
+uint64_t blocks_size = 0;
+
+// Disassembles the code of number instructions, stores each one in code the
+// first time it is seen and fills code_ids. Returns the number disassembled.
+size_t store_code(sqlite3 *db, sqlite3_stmt *code_insert, csh capstone_handle, uint8_t *code,
+                  uint64_t length, uint64_t *addresses, sqlite3_int64 *code_ids)
+{
+    char buffer[BUFFER_SIZE];
+    cs_insn *insn;
+    size_t i, count;
+    count = cs_disasm_ex(capstone_handle, code, length, addresses[0], 0, &insn);
+    for(i = 0; i < count; i++)
+    {
+        CodeEntry *entry;
+        if(2 * (code_table_used + 1) > code_table_size)
+            code_grow();
+        // Insert the static instruction the first time it is seen
+        entry = code_lookup(addresses[i], insn[i].bytes, insn[i].size);
+        if(entry->code_id == 0)
+        {
+            sqlite3_reset(code_insert);
+            sqlite3_bind_int64(code_insert, 1, addresses[i]);
+            snprintf(buffer, BUFFER_SIZE, "%s %s", insn[i].mnemonic, insn[i].op_str);
+            sqlite3_bind_text(code_insert, 2, buffer, -1, SQLITE_TRANSIENT);
+            sqlite3_bind_blob(code_insert, 3, insn[i].bytes, insn[i].size, SQLITE_TRANSIENT);
+            if(sqlite3_step(code_insert) != SQLITE_DONE)
+                printf("CODE error: %s\n", sqlite3_errmsg(db));
+            entry->address = addresses[i];
+            entry->size = insn[i].size;
+            memcpy(entry->bytes, insn[i].bytes, insn[i].size);
+            entry->code_id = sqlite3_last_insert_rowid(db);
+            code_table_used++;
+        }
+        code_ids[i] = entry->code_id;
+    }
+    cs_free(insn, count);
+    return count;
+}
+
+// Because ARM has special needs
+void arm_normalize(csh capstone_handle, uint64_t *addresses, uint64_t number)
+{
+    uint64_t i;
+    // ARM mode switching using the least significant bit of the PC
+    if(addresses[0]&1)
+        cs_option(capstone_handle, CS_OPT_MODE, CS_MODE_THUMB);
+    else
+        cs_option(capstone_handle, CS_OPT_MODE, CS_MODE_ARM);
+    // ARM address normalization
+    for(i = 0; i < number; i++)
+        addresses[i] &= 0xFFFFFFFFFFFFFFFE;
+}
+
 int fget_cstr(char *buffer, int size, FILE *file)
 {
     int i;
@@ -54,23 +168,42 @@ int fget_cstr(char *buffer, int size, FILE *file)
     return i;
 }
 
+uint64_t fget_varint(FILE *file)
+{
+    uint64_t v = 0;
+    int shift = 0, c;
+    while((c = fgetc(file)) != EOF)
+    {
+        v |= (uint64_t)(c & 0x7f) << shift;
+        if(!(c & 0x80))
+            break;
+        shift += 7;
+    }
+    return v;
+}
+
+uint64_t fget_delta(FILE *file, uint64_t *prev)
+{
+    return undoDelta(fget_varint(file), prev);
+}
+
 int main(int argc, char **argv)
 {
+    int protocol = 1;
+    DeltaState delta;
     csh capstone_handle;
     cs_arch arch;
     cs_mode mode;
-    cs_insn *insn;
     size_t size, count;
     Msg msg;
     int max_events = 128;
     int max_data = 1024;
     MemoryMsg *memory_events_buffer;
     int memory_events_idx = 0;
-    char buffer[BUFFER_SIZE];
     FILE *trace;
     sqlite3 *db;
     sqlite3_int64 bbl_id = 0, ins_id = 0;
-    sqlite3_stmt *info_insert, *bbl_insert, *lib_insert, *ins_insert, *mem_insert, *thread_insert, *thread_update;
+    sqlite3_stmt *info_insert, *bbl_insert, *lib_insert, *code_insert, *ins_insert, *mem_insert, *thread_insert, *thread_update;
 
     memory_events_buffer = (MemoryMsg*) malloc(sizeof(MemoryMsg)*max_events);
     if(argc < 3)
@@ -95,21 +228,31 @@ int main(int argc, char **argv)
     }
     sqlite3_prepare_v2(db, "INSERT INTO info (key, value) VALUES (?, ?);", -1, &info_insert, NULL);
     sqlite3_prepare_v2(db, "INSERT INTO lib (name, base, end) VALUES (?, ?, ?);", -1, &lib_insert, NULL);
-    sqlite3_prepare_v2(db, "INSERT INTO bbl (addr, addr_end, size, thread_id) VALUES (?, ?, ?, ?);", -1, &bbl_insert, NULL);
-    sqlite3_prepare_v2(db, "INSERT INTO ins (bbl_id, ip, dis, op) VALUES (?, ?, ?, ?);", -1, &ins_insert, NULL);
-    sqlite3_prepare_v2(db, "INSERT INTO mem (ins_id, ip, type, addr, addr_end, size, data, value) VALUES (?, ?, ?, ?, ?, ?, ?, ?);", -1, &mem_insert, NULL);
+    sqlite3_prepare_v2(db, "INSERT INTO bbl (addr, size, thread_id) VALUES (?, ?, ?);", -1, &bbl_insert, NULL);
+    sqlite3_prepare_v2(db, "INSERT INTO code (ip, dis, op) VALUES (?, ?, ?);", -1, &code_insert, NULL);
+    sqlite3_prepare_v2(db, "INSERT INTO ins (bbl_id, code_id) VALUES (?, ?);", -1, &ins_insert, NULL);
+    sqlite3_prepare_v2(db, "INSERT INTO mem (ins_id, type, addr, size, data) VALUES (?, ?, ?, ?, ?);", -1, &mem_insert, NULL);
     sqlite3_prepare_v2(db, "INSERT INTO thread (thread_id, start_bbl_id) VALUES (?, ?);", -1, &thread_insert, NULL);
     sqlite3_prepare_v2(db, "UPDATE thread SET exit_bbl_id=? WHERE thread_id=?;", -1, &thread_update, NULL);
 
     sqlite3_exec(db, "BEGIN;", NULL, NULL, NULL);
+    sqlite3_reset(info_insert);
+    sqlite3_bind_text(info_insert, 1, "SCHEMA_VERSION", -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(info_insert, 2, SCHEMA_VERSION, -1, SQLITE_TRANSIENT);
+    if(sqlite3_step(info_insert) != SQLITE_DONE)
+        printf("INFO error: %s\n", sqlite3_errmsg(db));
+    memset(&delta, 0, sizeof(delta));
     while(fread((void*)&(msg.type), 1, 1, trace) != 0)
     {
-        fread((void*)&(msg.length), 8, 1, trace);
+        if(protocol == 1 || msg.type == MSG_INFO || msg.type == MSG_LIB)
+            fread((void*)&(msg.length), 8, 1, trace);
         if(msg.type == MSG_INFO)
         {
             char key[128], value[BUFFER_SIZE];
             fget_cstr(key, 128, trace);
             fget_cstr(value, BUFFER_SIZE, trace);
+            if(strcmp(key, "PROTOCOL") == 0)
+                protocol = atoi(value);
             if(strcmp(key, "ARCH") == 0)
             {
                 if(strcmp(value, "AMD64") == 0)
@@ -161,77 +304,152 @@ int main(int argc, char **argv)
             fget_cstr(name, BUFFER_SIZE, trace);
             sqlite3_reset(lib_insert);
             sqlite3_bind_text(lib_insert, 1, name, -1, SQLITE_TRANSIENT);
-            snprintf(buffer, BUFFER_SIZE, "0x%016llx", lmsg.base);
-            sqlite3_bind_text(lib_insert, 2, buffer, -1, SQLITE_TRANSIENT);
-            snprintf(buffer, BUFFER_SIZE, "0x%016llx", lmsg.end);
-            sqlite3_bind_text(lib_insert, 3, buffer, -1, SQLITE_TRANSIENT);
+            sqlite3_bind_int64(lib_insert, 2, lmsg.base);
+            sqlite3_bind_int64(lib_insert, 3, lmsg.end);
             if(sqlite3_step(lib_insert) != SQLITE_DONE)
                 printf("LIB error: %s\n", sqlite3_errmsg(db));
         }
+        else if(msg.type == MSG_BLOCK)
+        {
+            int i;
+            uint8_t *code;
+            uint64_t id, first, length;
+            Block *block;
+
+            id = fget_varint(trace);
+            if(id >= blocks_size)
+            {
+                uint64_t old_size = blocks_size;
+                blocks_size = id >= 2 * old_size ? id + 1024 : 2 * old_size;
+                blocks = (Block*) realloc(blocks, sizeof(Block)*blocks_size);
+                memset(&blocks[old_size], 0, sizeof(Block)*(blocks_size - old_size));
+            }
+            block = &blocks[id];
+            free(block->addresses);
+            free(block->lengths);
+            free(block->code_ids);
+            first = fget_delta(trace, &delta.address);
+            block->number = fget_varint(trace);
+            length = fget_varint(trace);
+            block->addresses = (uint64_t*) malloc(block->number*8 + 8);
+            block->addresses[0] = first;
+            block->lengths = (uint8_t*) malloc(block->number);
+            block->code_ids = (sqlite3_int64*) malloc(block->number*sizeof(sqlite3_int64));
+            code = (uint8_t*) malloc(length);
+            fread((void*)block->lengths, 1, block->number, trace);
+            fread((void*)code, 1, length, trace);
+            for(i = 1; i < block->number; i++)
+                block->addresses[i] = block->addresses[i-1] + block->lengths[i-1];
+            if(arch == CS_ARCH_ARM)
+                arm_normalize(capstone_handle, block->addresses, block->number);
+            count = store_code(db, code_insert, capstone_handle, code, length,
+                               block->addresses, block->code_ids);
+            // Some validation to detect disassembly failure
+            if(count != block->number)
+            {
+                printf("Disassembly failure at block %llu!\n", (unsigned long long) id);
+                block->number = count;
+            }
+            free(code);
+        }
         else if(msg.type == MSG_EXEC)
         {
-            int i, j, k;
+            int i, j;
             uint8_t *code, *lengths;
             uint64_t* addresses;
+            sqlite3_int64 *code_ids;
             ExecMsg emsg;
 
-            fread((void*)&(emsg.exec_id), 8, 1, trace);
-            fread((void*)&(emsg.thread_id), 8, 1, trace);
-            fread((void*)&(emsg.number), 8, 1, trace);
-            fread((void*)&(emsg.length), 8, 1, trace);
-            if(41 + emsg.number*9 + emsg.length != msg.length)
+            if(protocol >= 3)
             {
-                printf("Incorrect msg length for ExecMsg %d.\n", emsg.exec_id);
-                printf("msg.length: %d emsg.number: %d emsg.length: %d.\n",
-                       msg.length, emsg.number, emsg.length);
-                exit(1);
+                Block *block;
+                emsg.exec_id = fget_delta(trace, &delta.exec_id);
+                emsg.thread_id = fget_delta(trace, &delta.thread_id);
+                emsg.block_id = fget_varint(trace);
+                emsg.number = fget_varint(trace);
+                if(emsg.block_id >= blocks_size || blocks[emsg.block_id].addresses == NULL)
+                {
+                    printf("Undefined block %llu at ExecMsg %llu.\n",
+                           (unsigned long long) emsg.block_id, (unsigned long long) emsg.exec_id);
+                    exit(1);
+                }
+                if(emsg.number == 0)
+                {
+                    printf("Empty execution of block %llu at ExecMsg %llu.\n",
+                           (unsigned long long) emsg.block_id, (unsigned long long) emsg.exec_id);
+                    exit(1);
+                }
+                block = &blocks[emsg.block_id];
+                if(emsg.number > block->number)
+                    emsg.number = block->number;
+                addresses = block->addresses;
+                code_ids = block->code_ids;
+                emsg.length = 0;
+                for(i = 0; i < emsg.number; i++)
+                    emsg.length += block->lengths[i];
+                count = emsg.number;
             }
-            addresses = (uint64_t*) malloc(emsg.number*8);
-            lengths = (uint8_t*) malloc(emsg.number);
-            code = (uint8_t*) malloc(emsg.length);
-            fread((void*)addresses, 8, emsg.number, trace);
-            fread((void*)lengths, 1, emsg.number, trace);
-            fread((void*)code, 1, emsg.length, trace);
-            // Because ARM has special needs
-            if(arch == CS_ARCH_ARM)
+            else
             {
-                // ARM mode switching using the least significant bit of the PC
-                if(arch == CS_ARCH_ARM && addresses[0]&1)
-                    mode = CS_MODE_THUMB;
+                if(protocol >= 2)
+                {
+                    uint64_t first;
+                    emsg.exec_id = fget_delta(trace, &delta.exec_id);
+                    emsg.thread_id = fget_delta(trace, &delta.thread_id);
+                    emsg.number = fget_varint(trace);
+                    emsg.length = fget_varint(trace);
+                    addresses = (uint64_t*) malloc(emsg.number*8);
+                    lengths = (uint8_t*) malloc(emsg.number);
+                    code = (uint8_t*) malloc(emsg.length);
+                    first = fget_delta(trace, &delta.address);
+                    fread((void*)lengths, 1, emsg.number, trace);
+                    fread((void*)code, 1, emsg.length, trace);
+                    for(i = 0; i < emsg.number; i++)
+                        addresses[i] = i == 0 ? first : addresses[i-1] + lengths[i-1];
+                }
                 else
-                    mode = CS_MODE_ARM;
-                // ARM address normalization
-                for(i = 0; i < emsg.number; i++)
-                    addresses[i] &= 0xFFFFFFFFFFFFFFFE;
-                cs_option(capstone_handle, CS_OPT_MODE, mode);
+                {
+                    fread((void*)&(emsg.exec_id), 8, 1, trace);
+                    fread((void*)&(emsg.thread_id), 8, 1, trace);
+                    fread((void*)&(emsg.number), 8, 1, trace);
+                    fread((void*)&(emsg.length), 8, 1, trace);
+                    if(41 + emsg.number*9 + emsg.length != msg.length)
+                    {
+                        printf("Incorrect msg length for ExecMsg %d.\n", emsg.exec_id);
+                        printf("msg.length: %d emsg.number: %d emsg.length: %d.\n",
+                               msg.length, emsg.number, emsg.length);
+                        exit(1);
+                    }
+                    addresses = (uint64_t*) malloc(emsg.number*8);
+                    lengths = (uint8_t*) malloc(emsg.number);
+                    code = (uint8_t*) malloc(emsg.length);
+                    fread((void*)addresses, 8, emsg.number, trace);
+                    fread((void*)lengths, 1, emsg.number, trace);
+                    fread((void*)code, 1, emsg.length, trace);
+                }
+                if(arch == CS_ARCH_ARM)
+                    arm_normalize(capstone_handle, addresses, emsg.number);
+                code_ids = (sqlite3_int64*) malloc(emsg.number*sizeof(sqlite3_int64));
+                count = store_code(db, code_insert, capstone_handle, code, emsg.length,
+                                   addresses, code_ids);
+                // Some validation to detect disassembly failure
+                if(count != emsg.number)
+                    printf("Disassembly failure at ExecMsg %d!\n", emsg.exec_id);
             }
             // Insert BBL
             sqlite3_reset(bbl_insert);
-            snprintf(buffer, BUFFER_SIZE, "0x%016llx", addresses[0]);
-            sqlite3_bind_text(bbl_insert, 1, buffer, -1, SQLITE_TRANSIENT);
-            snprintf(buffer, BUFFER_SIZE, "0x%016llx", addresses[0]+emsg.length-1);
-            sqlite3_bind_text(bbl_insert, 2, buffer, -1, SQLITE_TRANSIENT);
-            sqlite3_bind_int(bbl_insert, 3, emsg.length);
-            sqlite3_bind_int64(bbl_insert, 4, emsg.thread_id);
+            sqlite3_bind_int64(bbl_insert, 1, addresses[0]);
+            sqlite3_bind_int(bbl_insert, 2, emsg.length);
+            sqlite3_bind_int64(bbl_insert, 3, emsg.thread_id);
             if(sqlite3_step(bbl_insert) != SQLITE_DONE)
                 printf("BBL error: %s\n", sqlite3_errmsg(db));
             bbl_id = sqlite3_last_insert_rowid(db);
-            count = cs_disasm_ex(capstone_handle, code, emsg.length, addresses[0], 0, &insn);
-            // Some validation to detect disassembly failure
-            if(count != emsg.number)
-                printf("Disassembly failure at ExecMsg %d!\n", emsg.exec_id);
             for(i = 0; i < count; i++)
             {
                 // Insert instruction
                 sqlite3_reset(ins_insert);
                 sqlite3_bind_int64(ins_insert, 1, bbl_id);
-                snprintf(buffer, BUFFER_SIZE, "0x%016llx", addresses[i]);
-                sqlite3_bind_text(ins_insert, 2, buffer, -1, SQLITE_TRANSIENT);
-                snprintf(buffer, BUFFER_SIZE, "%s %s", insn[i].mnemonic, insn[i].op_str);
-                sqlite3_bind_text(ins_insert, 3, buffer, -1, SQLITE_TRANSIENT);
-                for(j = 0; j < insn[i].size && j*2+1 < BUFFER_SIZE; j++)
-                    snprintf(buffer+j*2, BUFFER_SIZE, "%02hhx", insn[i].bytes[j]);
-                sqlite3_bind_text(ins_insert, 4, buffer, -1, SQLITE_TRANSIENT);
+                sqlite3_bind_int64(ins_insert, 2, code_ids[i]);
                 if(sqlite3_step(ins_insert) != SQLITE_DONE)
                     printf("INS error: %s\n", sqlite3_errmsg(db));
                 ins_id = sqlite3_last_insert_rowid(db);
@@ -244,30 +462,14 @@ int main(int argc, char **argv)
                         // Insert read or write
                         sqlite3_reset(mem_insert);
                         sqlite3_bind_int64(mem_insert, 1, ins_id);
-                        snprintf(buffer, BUFFER_SIZE, "0x%016llx", addresses[i]);
-                        sqlite3_bind_text(mem_insert, 2, buffer, -1, SQLITE_TRANSIENT);
                         if(memory_events_buffer[j].mode == MODE_READ)
-                            sqlite3_bind_text(mem_insert, 3, "R", -1, SQLITE_TRANSIENT);
+                            sqlite3_bind_text(mem_insert, 2, "R", -1, SQLITE_TRANSIENT);
                         else if(memory_events_buffer[j].mode == MODE_WRITE)
-                            sqlite3_bind_text(mem_insert, 3, "W", -1, SQLITE_TRANSIENT);
-                        snprintf(buffer, BUFFER_SIZE, "0x%016llx", memory_events_buffer[j].start_address);
-                        sqlite3_bind_text(mem_insert, 4, buffer, -1, SQLITE_TRANSIENT);
-                        snprintf(buffer, BUFFER_SIZE, "0x%016llx", memory_events_buffer[j].start_address + 
-                                 memory_events_buffer[j].length - 1);
-                        sqlite3_bind_text(mem_insert, 5, buffer, -1, SQLITE_TRANSIENT);
-                        sqlite3_bind_int(mem_insert, 6, memory_events_buffer[j].length);
-                        for(k = 0; k < memory_events_buffer[j].length && k*2+1 < BUFFER_SIZE; k++)
-                            snprintf(buffer+k*2, BUFFER_SIZE, "%02hhx", memory_events_buffer[j].data[k]);
-                        sqlite3_bind_text(mem_insert, 7, buffer, -1, SQLITE_TRANSIENT);
-                        if(memory_events_buffer[j].length == 1)
-                            snprintf(buffer, BUFFER_SIZE, "0x%02hhx", *((uint8_t*)memory_events_buffer[j].data));
-                        else if(memory_events_buffer[j].length == 2)
-                            snprintf(buffer, BUFFER_SIZE, "0x%04hx", *((uint16_t*)memory_events_buffer[j].data));
-                        else if(memory_events_buffer[j].length == 4)
-                            snprintf(buffer, BUFFER_SIZE, "0x%08x", *((uint32_t*)memory_events_buffer[j].data));
-                        else if(memory_events_buffer[j].length == 8)
-                            snprintf(buffer, BUFFER_SIZE, "0x%016llx", *((uint64_t*)memory_events_buffer[j].data));
-                        sqlite3_bind_text(mem_insert, 8, buffer, -1, SQLITE_TRANSIENT);
+                            sqlite3_bind_text(mem_insert, 2, "W", -1, SQLITE_TRANSIENT);
+                        sqlite3_bind_int64(mem_insert, 3, memory_events_buffer[j].start_address);
+                        sqlite3_bind_int(mem_insert, 4, memory_events_buffer[j].length);
+                        sqlite3_bind_blob(mem_insert, 5, memory_events_buffer[j].data,
+                                          memory_events_buffer[j].length, SQLITE_TRANSIENT);
                         if(sqlite3_step(mem_insert) != SQLITE_DONE)
                             printf("MEM error: %s\n", sqlite3_errmsg(db));
                         memory_events_buffer[j].mode = MODE_INVALID;
@@ -286,10 +488,13 @@ int main(int argc, char **argv)
                 // That's embarassing ...
                 printf("%d memory events leaked at EXEC_ID: %d!\n", j, emsg.exec_id);
             memory_events_idx = 0;
-            cs_free(insn, count);
-            free(addresses);
-            free(lengths);
-            free(code);
+            if(protocol < 3)
+            {
+                free(addresses);
+                free(lengths);
+                free(code);
+                free(code_ids);
+            }
         }
         else if(msg.type == MSG_MEMORY)
         {
@@ -302,15 +507,28 @@ int main(int argc, char **argv)
                                                             sizeof(MemoryMsg)*max_events);
             }
             MemoryMsg *mmsg = &(memory_events_buffer[memory_events_idx]);
-            fread((void*)&(mmsg->exec_id), 8, 1, trace);
-            fread((void*)&(mmsg->ins_address), 8, 1, trace);
-            fread((void*)&(mmsg->mode), 1, 1, trace);
-            fread((void*)&(mmsg->start_address), 8, 1, trace);
-            fread((void*)&(mmsg->length), 8, 1, trace);
-            if(mmsg->length != msg.length-42)
+            if(protocol >= 2)
+            {
+                uint64_t mode_length;
+                mmsg->exec_id = fget_delta(trace, &delta.exec_id);
+                mmsg->ins_address = fget_delta(trace, &delta.ins_address);
+                mode_length = fget_varint(trace);
+                mmsg->mode = mode_length & 1;
+                mmsg->length = mode_length >> 1;
+                mmsg->start_address = fget_delta(trace, &delta.start_address);
+            }
+            else
             {
-                printf("MemoryMsg %d has an invalid code length.\n", mmsg->exec_id);
-                exit(1);
+                fread((void*)&(mmsg->exec_id), 8, 1, trace);
+                fread((void*)&(mmsg->ins_address), 8, 1, trace);
+                fread((void*)&(mmsg->mode), 1, 1, trace);
+                fread((void*)&(mmsg->start_address), 8, 1, trace);
+                fread((void*)&(mmsg->length), 8, 1, trace);
+                if(mmsg->length != msg.length-42)
+                {
+                    printf("MemoryMsg %d has an invalid code length.\n", mmsg->exec_id);
+                    exit(1);
+                }
             }
             mmsg->data = (uint8_t*) malloc(mmsg->length);
             fread((void*)mmsg->data, 1, mmsg->length, trace);
@@ -319,9 +537,18 @@ int main(int argc, char **argv)
         else if(msg.type == MSG_THREAD)
         {
             ThreadMsg tmsg;
-            fread((void*)&(tmsg.exec_id), 8, 1, trace);
-            fread((void*)&(tmsg.thread_id), 8, 1, trace);
-            fread((void*)&(tmsg.type), 1, 1, trace);
+            if(protocol >= 2)
+            {
+                tmsg.exec_id = fget_delta(trace, &delta.exec_id);
+                tmsg.thread_id = fget_varint(trace);
+                fread((void*)&(tmsg.type), 1, 1, trace);
+            }
+            else
+            {
+                fread((void*)&(tmsg.exec_id), 8, 1, trace);
+                fread((void*)&(tmsg.thread_id), 8, 1, trace);
+                fread((void*)&(tmsg.type), 1, 1, trace);
+            }
             if(tmsg.type == THREAD_CREATE)
             {
                 sqlite3_reset(thread_insert);
@@ -351,6 +578,7 @@ int main(int argc, char **argv)
     sqlite3_finalize(info_insert);
     sqlite3_finalize(lib_insert);
     sqlite3_finalize(bbl_insert);
+    sqlite3_finalize(code_insert);
     sqlite3_finalize(ins_insert);
     sqlite3_finalize(mem_insert);
     sqlite3_finalize(thread_insert);
@@ -363,5 +591,13 @@ int main(int argc, char **argv)
     cs_close(&capstone_handle);
     fclose(trace);
     free(memory_events_buffer);
+    for(size = 0; size < blocks_size; size++)
+    {
+        free(blocks[size].addresses);
+        free(blocks[size].lengths);
+        free(blocks[size].code_ids);
+    }
+    free(blocks);
+    free(code_table);
     return 0;
 }
@@ -23,12 +23,25 @@
 #define _FILE_OFFSET_BITS 64 
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <capstone/capstone.h>
 #include "../tracergrind/trace_protocol.h"
 
 #define BUFFER_SIZE 2048
 
+// Block definitions of protocol 3, indexed by ID and disassembled once
+typedef struct
+{
+    uint64_t number;
+    uint64_t *addresses;
+    cs_insn *insn;
+    size_t count;
+} Block;
+
+Block *blocks = NULL;
+uint64_t blocks_size = 0;
+
 int fget_cstr(char *buffer, int size, FILE *file)
 {
     int i;
@@ -44,8 +57,29 @@ int fget_cstr(char *buffer, int size, FILE *file)
     return i;
 }
 
+uint64_t fget_varint(FILE *file)
+{
+    uint64_t v = 0;
+    int shift = 0, c;
+    while((c = fgetc(file)) != EOF)
+    {
+        v |= (uint64_t)(c & 0x7f) << shift;
+        if(!(c & 0x80))
+            break;
+        shift += 7;
+    }
+    return v;
+}
+
+uint64_t fget_delta(FILE *file, uint64_t *prev)
+{
+    return undoDelta(fget_varint(file), prev);
+}
+
 int main(int argc, char **argv)
 {
+    int protocol = 1;
+    DeltaState delta;
     csh capstone_handle;
     cs_arch arch;
     cs_mode mode;
@@ -71,14 +105,18 @@ int main(int argc, char **argv)
         printf("Could not open file %s for writing\n", argv[2]);
         return 3;
     }
+    memset(&delta, 0, sizeof(delta));
     while(fread((void*)&(msg.type), 1, 1, trace) != 0)
     {
-        fread((void*)&(msg.length), 8, 1, trace);
+        if(protocol == 1 || msg.type == MSG_INFO || msg.type == MSG_LIB)
+            fread((void*)&(msg.length), 8, 1, trace);
         if(msg.type == MSG_INFO)
         {
             char key[128], value[BUFFER_SIZE];
             fget_cstr(key, 128, trace);
             fget_cstr(value, BUFFER_SIZE, trace);
+            if(strcmp(key, "PROTOCOL") == 0)
+                protocol = atoi(value);
             if(strcmp(key, "ARCH") == 0)
             {
                 if(strcmp(value, "AMD64") == 0)
@@ -127,29 +165,130 @@ int main(int argc, char **argv)
             fprintf(texttrace, "[L] Loaded %s from 0x%016llx to 0x%016llx\n",
                     name, lmsg.base, lmsg.end);
         }
+        else if(msg.type == MSG_BLOCK)
+        {
+            int i;
+            uint8_t *code, *lengths;
+            uint64_t id, first, length;
+            Block *block;
+
+            id = fget_varint(trace);
+            if(id >= blocks_size)
+            {
+                uint64_t old_size = blocks_size;
+                blocks_size = id >= 2 * old_size ? id + 1024 : 2 * old_size;
+                blocks = (Block*) realloc(blocks, sizeof(Block)*blocks_size);
+                memset(&blocks[old_size], 0, sizeof(Block)*(blocks_size - old_size));
+            }
+            block = &blocks[id];
+            free(block->addresses);
+            if(block->insn != NULL)
+                cs_free(block->insn, block->count);
+            first = fget_delta(trace, &delta.address);
+            block->number = fget_varint(trace);
+            length = fget_varint(trace);
+            lengths = (uint8_t*) malloc(block->number);
+            code = (uint8_t*) malloc(length);
+            fread((void*)lengths, 1, block->number, trace);
+            fread((void*)code, 1, length, trace);
+            block->addresses = (uint64_t*) malloc(block->number*8 + 8);
+            block->addresses[0] = first;
+            for(i = 1; i < block->number; i++)
+                block->addresses[i] = block->addresses[i-1] + lengths[i-1];
+            // Because ARM has special needs
+            if(arch == CS_ARCH_ARM)
+            {
+                // ARM mode switching using the least significant bit of the PC
+                if(block->addresses[0]&1)
+                    mode = CS_MODE_THUMB;
+                else
+                    mode = CS_MODE_ARM;
+                // ARM address normalization
+                for(i = 0; i < block->number; i++)
+                    block->addresses[i] &= 0xFFFFFFFFFFFFFFFE;
+                cs_option(capstone_handle, CS_OPT_MODE, mode);
+            }
+            block->count = cs_disasm_ex(capstone_handle, code, length, block->addresses[0], 0, &(block->insn));
+            // Some validation to detect disassembly failure
+            if(block->count != block->number)
+                printf("Disassembly failure at block %llu!\n", (unsigned long long) id);
+            free(code);
+            free(lengths);
+        }
+        else if(msg.type == MSG_EXEC && protocol >= 3)
+        {
+            int i;
+            ExecMsg emsg;
+            Block *block;
+            emsg.exec_id = fget_delta(trace, &delta.exec_id);
+            emsg.thread_id = fget_delta(trace, &delta.thread_id);
+            emsg.block_id = fget_varint(trace);
+            emsg.number = fget_varint(trace);
+            if(emsg.block_id >= blocks_size || blocks[emsg.block_id].addresses == NULL)
+            {
+                printf("Undefined block %llu at ExecMsg %llu.\n",
+                       (unsigned long long) emsg.block_id, (unsigned long long) emsg.exec_id);
+                exit(1);
+            }
+            if(emsg.number == 0)
+            {
+                printf("Empty execution of block %llu at ExecMsg %llu.\n",
+                       (unsigned long long) emsg.block_id, (unsigned long long) emsg.exec_id);
+                exit(1);
+            }
+            block = &blocks[emsg.block_id];
+            if(emsg.number > block->number)
+                emsg.number = block->number;
+            fprintf(texttrace,"[B] EXEC_ID: %lld THREAD_ID: %016llx START_ADDRESS: %016llx END_ADDRESS: %016llx\n",
+                    (long long) emsg.exec_id, (unsigned long long) emsg.thread_id,
+                    (unsigned long long) block->addresses[0],
+                    (unsigned long long) block->addresses[emsg.number-1]);
+            for(i = 0; i < emsg.number && i < block->count; i++)
+                fprintf(texttrace, "[I] %016llx: %s %s\n", (unsigned long long) block->insn[i].address,
+                        block->insn[i].mnemonic, block->insn[i].op_str);
+        }
         else if(msg.type == MSG_EXEC)
         {
             int i;
             uint8_t *code, *lengths;
             uint64_t* addresses;
             ExecMsg emsg;
-            fread((void*)&(emsg.exec_id), 8, 1, trace);
-            fread((void*)&(emsg.thread_id), 8, 1, trace);
-            fread((void*)&(emsg.number), 8, 1, trace);
-            fread((void*)&(emsg.length), 8, 1, trace);
-            if(41 + emsg.number*9 + emsg.length != msg.length)
+            if(protocol >= 2)
             {
-                printf("Incorrect msg length for ExecMsg %d.\n", emsg.exec_id);
-                printf("msg.length: %d emsg.number: %d emsg.length: %d.\n",
-                       msg.length, emsg.number, emsg.length);
-                exit(1);
+                uint64_t first;
+                emsg.exec_id = fget_delta(trace, &delta.exec_id);
+                emsg.thread_id = fget_delta(trace, &delta.thread_id);
+                emsg.number = fget_varint(trace);
+                emsg.length = fget_varint(trace);
+                addresses = (uint64_t*) malloc(emsg.number*8);
+                lengths = (uint8_t*) malloc(emsg.number);
+                code = (uint8_t*) malloc(emsg.length);
+                first = fget_delta(trace, &delta.address);
+                fread((void*)lengths, 1, emsg.number, trace);
+                fread((void*)code, 1, emsg.length, trace);
+                for(i = 0; i < emsg.number; i++)
+                    addresses[i] = i == 0 ? first : addresses[i-1] + lengths[i-1];
+            }
+            else
+            {
+                fread((void*)&(emsg.exec_id), 8, 1, trace);
+                fread((void*)&(emsg.thread_id), 8, 1, trace);
+                fread((void*)&(emsg.number), 8, 1, trace);
+                fread((void*)&(emsg.length), 8, 1, trace);
+                if(41 + emsg.number*9 + emsg.length != msg.length)
+                {
+                    printf("Incorrect msg length for ExecMsg %d.\n", emsg.exec_id);
+                    printf("msg.length: %d emsg.number: %d emsg.length: %d.\n",
+                           msg.length, emsg.number, emsg.length);
+                    exit(1);
+                }
+                addresses = (uint64_t*) malloc(emsg.number*8);
+                lengths = (uint8_t*) malloc(emsg.number);
+                code = (uint8_t*) malloc(emsg.length);
+                fread((void*)addresses, 8, emsg.number, trace);
+                fread((void*)lengths, 1, emsg.number, trace);
+                fread((void*)code, 1, emsg.length, trace);
             }
-            addresses = (uint64_t*) malloc(emsg.number*8);
-            lengths = (uint8_t*) malloc(emsg.number);
-            code = (uint8_t*) malloc(emsg.length);
-            fread((void*)addresses, 8, emsg.number, trace);
-            fread((void*)lengths, 1, emsg.number, trace);
-            fread((void*)code, 1, emsg.length, trace);
             // Because ARM has special needs
             if(arch == CS_ARCH_ARM)
             {
@@ -181,15 +320,28 @@ int main(int argc, char **argv)
             int i;
             uint8_t *data;
             MemoryMsg mmsg;
-            fread((void*)&(mmsg.exec_id), 8, 1, trace);
-            fread((void*)&(mmsg.ins_address), 8, 1, trace);
-            fread((void*)&(mmsg.mode), 1, 1, trace);
-            fread((void*)&(mmsg.start_address), 8, 1, trace);
-            fread((void*)&(mmsg.length), 8, 1, trace);
-            if(mmsg.length != msg.length-42)
+            if(protocol >= 2)
             {
-                printf("MemoryMsg %d has an invalid code length.\n", mmsg.exec_id);
-                exit(1);
+                uint64_t mode_length;
+                mmsg.exec_id = fget_delta(trace, &delta.exec_id);
+                mmsg.ins_address = fget_delta(trace, &delta.ins_address);
+                mode_length = fget_varint(trace);
+                mmsg.mode = mode_length & 1;
+                mmsg.length = mode_length >> 1;
+                mmsg.start_address = fget_delta(trace, &delta.start_address);
+            }
+            else
+            {
+                fread((void*)&(mmsg.exec_id), 8, 1, trace);
+                fread((void*)&(mmsg.ins_address), 8, 1, trace);
+                fread((void*)&(mmsg.mode), 1, 1, trace);
+                fread((void*)&(mmsg.start_address), 8, 1, trace);
+                fread((void*)&(mmsg.length), 8, 1, trace);
+                if(mmsg.length != msg.length-42)
+                {
+                    printf("MemoryMsg %d has an invalid code length.\n", mmsg.exec_id);
+                    exit(1);
+                }
             }
             data = (uint8_t*) malloc(mmsg.length);
             fread((void*)data, 1, mmsg.length, trace);
@@ -207,9 +359,18 @@ int main(int argc, char **argv)
         else if(msg.type == MSG_THREAD)
         {
             ThreadMsg tmsg;
-            fread((void*)&(tmsg.exec_id), 8, 1, trace);
-            fread((void*)&(tmsg.thread_id), 8, 1, trace);
-            fread((void*)&(tmsg.type), 1, 1, trace);
+            if(protocol >= 2)
+            {
+                tmsg.exec_id = fget_delta(trace, &delta.exec_id);
+                tmsg.thread_id = fget_varint(trace);
+                fread((void*)&(tmsg.type), 1, 1, trace);
+            }
+            else
+            {
+                fread((void*)&(tmsg.exec_id), 8, 1, trace);
+                fread((void*)&(tmsg.thread_id), 8, 1, trace);
+                fread((void*)&(tmsg.type), 1, 1, trace);
+            }
             fprintf(texttrace, "[T] EXEC_ID: %d THREAD_ID: %016llx TYPE: ", tmsg.exec_id, tmsg.thread_id);
             if(tmsg.type == THREAD_CREATE)
                 fprintf(texttrace, "THREAD_CREATE\n");
@@ -224,6 +385,13 @@ int main(int argc, char **argv)
             exit(1);
         }
     }
+    for(size = 0; size < blocks_size; size++)
+    {
+        free(blocks[size].addresses);
+        if(blocks[size].insn != NULL)
+            cs_free(blocks[size].insn, blocks[size].count);
+    }
+    free(blocks);
     cs_close(&capstone_handle);
     fclose(trace);
     fclose(texttrace);
@@ -0,0 +1,100 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../trace_protocol.h"
+
+// Checks that each EXEC of a protocol 3 trace refers to a block defined by a
+// preceding BLOCK message
+
+uint64_t fget_varint(FILE *file)
+{
+    uint64_t v = 0;
+    int shift = 0, c;
+    while((c = fgetc(file)) != EOF)
+    {
+        v |= (uint64_t)(c & 0x7f) << shift;
+        if(!(c & 0x80))
+            break;
+        shift += 7;
+    }
+    return v;
+}
+
+int main(int argc, char **argv)
+{
+    uint8_t type, *defined = NULL;
+    uint64_t length, size = 0, id, number, execs = 0;
+    FILE *trace;
+    if(argc < 2)
+    {
+        printf("Usage: check_blocks <trace>\n");
+        return 1;
+    }
+    trace = fopen(argv[1], "rb");
+    if(trace == NULL)
+    {
+        printf("Could not open file %s for reading\n", argv[1]);
+        return 2;
+    }
+    while(fread((void*)&type, 1, 1, trace) != 0)
+    {
+        if(type == MSG_INFO || type == MSG_LIB)
+        {
+            fread((void*)&length, 8, 1, trace);
+            fseek(trace, length - 9, SEEK_CUR);
+        }
+        else if(type == MSG_BLOCK)
+        {
+            id = fget_varint(trace);
+            fget_varint(trace);
+            number = fget_varint(trace);
+            length = fget_varint(trace);
+            fseek(trace, number + length, SEEK_CUR);
+            if(id >= size)
+            {
+                uint64_t old_size = size;
+                size = id + 1024;
+                defined = (uint8_t*) realloc(defined, size);
+                memset(&defined[old_size], 0, size - old_size);
+            }
+            defined[id] = 1;
+        }
+        else if(type == MSG_EXEC)
+        {
+            fget_varint(trace);
+            fget_varint(trace);
+            id = fget_varint(trace);
+            fget_varint(trace);
+            if(id >= size || !defined[id])
+            {
+                printf("Undefined block %llu at EXEC %llu\n",
+                       (unsigned long long) id, (unsigned long long) execs);
+                return 1;
+            }
+            execs++;
+        }
+        else if(type == MSG_MEMORY)
+        {
+            fget_varint(trace);
+            fget_varint(trace);
+            length = fget_varint(trace) >> 1;
+            fget_varint(trace);
+            fseek(trace, length, SEEK_CUR);
+        }
+        else if(type == MSG_THREAD)
+        {
+            fget_varint(trace);
+            fget_varint(trace);
+            fgetc(trace);
+        }
+        else
+        {
+            printf("Invalid message of type %d\n", type);
+            return 1;
+        }
+    }
+    printf(execs > 0 ? "ok\n" : "no EXEC\n");
+    free(defined);
+    fclose(trace);
+    return 0;
+}
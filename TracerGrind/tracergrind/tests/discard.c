@@ -0,0 +1,16 @@
+#include "valgrind.h"
+
+// The block ending with the client request is still pending when its
+// translation is discarded, its EXEC is sent after the discard
+static void discard_self(void)
+{
+    VALGRIND_DISCARD_TRANSLATIONS((void*)&discard_self, 4096);
+}
+
+int main(void)
+{
+    int i;
+    for(i = 0; i < 3; i++)
+        discard_self();
+    return 0;
+}
@@ -23,18 +23,25 @@
 #include "pub_tool_basics.h"
 #include "pub_tool_tooliface.h"
 #include "pub_tool_vki.h"
+#include "pub_tool_vkiscnums.h"
 #include "pub_tool_libcbase.h"
 #include "pub_tool_libcfile.h"
 #include "pub_tool_libcassert.h"
 #include "pub_tool_libcprint.h"
+#include "pub_tool_libcproc.h"
 #include "pub_tool_debuginfo.h"
 #include "pub_tool_options.h"
 #include "pub_tool_machine.h"
+#include "pub_tool_mallocfree.h"
+#include "pub_tool_oset.h"
+#include "pub_tool_stacktrace.h"
+#include "pub_tool_threadstate.h"
 #include "pub_tool_xarray.h"
 #include "pub_tool_clientstate.h"
 
 #include "trace_protocol.h"
 #include "version.h"
+#include "tracergrind.h"
 
 static uint64_t thread_id = 0;
 static uint64_t exec_id = 0;
@@ -59,6 +66,8 @@ static HChar *filter_mem_str;
 static HChar *filters_mem[MAX_FILTER];
 static HChar *filter_bblock_str;
 static HChar *filters_bblock[MAX_FILTER];
+static HChar *filter_alloc_str;
+static HChar *filters_alloc[MAX_FILTER];
 static Int trace_output_fd = 0;
 static Addr filter_instr_start[MAX_FILTER], filter_instr_end[MAX_FILTER];
 static Addr filter_mem_start[MAX_FILTER], filter_mem_end[MAX_FILTER];
@@ -66,15 +75,38 @@ static Int filter_bblock_start[MAX_FILTER], filter_bblock_end[MAX_FILTER];
 static int filter_instr_number = 0;
 static int filter_mem_number = 0;
 static int filter_bblock_number = 0;
+static int filter_alloc_number = 0;
+static SizeT filter_alloc_size_min[MAX_FILTER], filter_alloc_size_max[MAX_FILTER];
+static Addr filter_alloc_site[MAX_FILTER];
+static int filter_alloc_size_number = 0;
+static int filter_alloc_site_number = 0;
 static int trace_instr = 1;
 static int trace_mem_read = 1;
 static int trace_mem_write = 1;
+static int filter_stack = 0;
 
-static int memory_events_idx = 0;
-static int memory_buffer_idx = 0;
-static uint8_t memory_buffer[MEM_BUFFER_SIZE];
+// Memory events of the current block, each one is a header of three HWords
+// (instruction address, start address, length << 1 | mode) followed by the
+// data, both aligned on 16 bytes for vector stores. They are appended by
+// readCallback/writeCallback or by inline IR for plain loads and stores
+// (addMemEvent), which only checks that mem_events_idx is within
+// MEM_BUFFER_SIZE: there is always room for one more event of up to 128
+// bytes after it.
+#define EVENT_HEADER ((3 * sizeof(HWord) + 15) & ~15)
+#define EVENT_SIZE(length) (EVENT_HEADER + (((length) + 15) & ~15))
+static UChar mem_events[MEM_BUFFER_SIZE + EVENT_SIZE(128)] __attribute__((aligned(16)));
+static HWord mem_events_idx = 0;
 static uint8_t msg_buffer[MSG_BUFFER_SIZE];
-static MemoryMsg memory_events[MAX_MEMORY_EVENT];
+// Messages are serialized back to back in out_buffer and written when it
+// is full, at thread switches (--flush-on-switch) and at the end
+static uint8_t *out_buffer = NULL;
+static SizeT out_buffer_size = 0;
+static SizeT out_buffer_idx = 0;
+static Long output_buffer_kb = 8192;
+static int flush_on_switch = 1;
+static ThreadId last_tid = VG_INVALID_THREADID;
+static Long protocol_version = PROTOCOL_VERSION;
+static DeltaState delta_state;
 static int code_buffer_idx = 0;
 static int code_event_idx = 0;
 static uint64_t address_buffer[MAX_CODE_EVENT];
@@ -83,7 +115,82 @@ static uint8_t code_buffer[CODE_BUFFER_SIZE];
 static uint32_t thread_counter = 0;
 static uint64_t thread_ids[MAX_THREAD];
 
+#if defined(VG_BIGENDIAN)
+#   define END Iend_BE
+#elif defined(VG_LITTLEENDIAN)
+#   define END Iend_LE
+#else
+#   error "Unknown endianness"
+#endif
+
+// Protocol 3: each run of contiguous instructions of a translated superblock
+// is a block, defined once. block_defs is indexed by block ID, the code of a
+// definition is freed once sent, the lengths when its translation is
+// discarded.
+typedef struct
+{
+    BlockMsg msg;
+    Addr code_addr;     // where the code was copied from
+    Bool sent;
+} BlockDef;
+
+typedef struct
+{
+    Word first;     // blocks first .. first+count-1 of one translation
+    Word count;
+} BlockRange;
+
+typedef struct
+{
+    Addr addr;              // guest address of the superblock
+    XArray *translations;   // BlockRange of each of its translations
+} SbBlocks;
+
+static XArray *block_defs = NULL;
+static OSet *sb_blocks = NULL;
+static Word cur_block = -1;
+static UInt exec_ins = 0;      // instructions executed in cur_block
+
 // ---- Trace file format helper functions ----
+static void writeAll(UInt fd, uint8_t *data, SizeT length)
+{
+    while(length > 0)
+    {
+        Int n = VG_(write)(fd, data, length);
+        if(n <= 0)
+            break;
+        data += n;
+        length -= n;
+    }
+}
+
+static void flushOutput(UInt fd)
+{
+    writeAll(fd, out_buffer, out_buffer_idx);
+    out_buffer_idx = 0;
+}
+
+// Room for a message of length bytes. Messages larger than the output
+// buffer, or all of them without one, go through msg_buffer and are
+// written right away by commitMsg.
+static uint8_t *reserveMsg(UInt fd, SizeT length)
+{
+    if(out_buffer_idx + length > out_buffer_size)
+        flushOutput(fd);
+    if(length > out_buffer_size)
+        return msg_buffer;
+    return &(out_buffer[out_buffer_idx]);
+}
+
+// length may be less than what was reserved
+static void commitMsg(UInt fd, uint8_t *buf, SizeT length)
+{
+    if(buf == msg_buffer)
+        writeAll(fd, msg_buffer, length);
+    else
+        out_buffer_idx += length;
+}
+
 Bool traceBblock(Int i)
 {
     Int        j;
@@ -111,45 +218,94 @@ void sendInfoMsg(UInt fd, InfoMsg *info_msg)
 {
     uint8_t type = MSG_INFO;
     uint64_t length = 9; // msg header
-    VG_(memcpy)((void*)msg_buffer, &type, 1);
-    VG_(strcpy)((HChar*)&(msg_buffer[9]), info_msg->key);
-    length += VG_(strlen)(info_msg->key)+1;
-    VG_(strcpy)((HChar*)&(msg_buffer[length]), info_msg->value);
-    length += VG_(strlen)(info_msg->value)+1;
-    VG_(memcpy)((void*)&(msg_buffer[1]), &length, 8);
-    VG_(write)(fd, (void*)msg_buffer, length);
+    uint64_t key_length = VG_(strlen)(info_msg->key)+1;
+    uint8_t *buf;
+    length += key_length + VG_(strlen)(info_msg->value)+1;
+    buf = reserveMsg(fd, length);
+    VG_(memcpy)((void*)buf, &type, 1);
+    VG_(memcpy)((void*)&(buf[1]), &length, 8);
+    VG_(strcpy)((HChar*)&(buf[9]), info_msg->key);
+    VG_(strcpy)((HChar*)&(buf[9+key_length]), info_msg->value);
+    commitMsg(fd, buf, length);
 }
 
 void sendLibMsg(UInt fd, LibMsg *lib_msg)
 {
     uint8_t type = MSG_LIB;
     uint64_t length = 25; // msg header
+    uint8_t *buf;
     length += VG_(strlen)(lib_msg->name)+1;
-    VG_(memcpy)((void*)msg_buffer, &type, 1);
-    VG_(memcpy)((void*)&(msg_buffer[1]), &length, 8);
-    VG_(memcpy)((void*)&(msg_buffer[9]), &(lib_msg->base), 8);
-    VG_(memcpy)((void*)&(msg_buffer[17]), &(lib_msg->end), 8);
-    VG_(strcpy)((HChar*)&(msg_buffer[25]), lib_msg->name);
-    VG_(write)(fd, msg_buffer, length);
+    buf = reserveMsg(fd, length);
+    VG_(memcpy)((void*)buf, &type, 1);
+    VG_(memcpy)((void*)&(buf[1]), &length, 8);
+    VG_(memcpy)((void*)&(buf[9]), &(lib_msg->base), 8);
+    VG_(memcpy)((void*)&(buf[17]), &(lib_msg->end), 8);
+    VG_(strcpy)((HChar*)&(buf[25]), lib_msg->name);
+    commitMsg(fd, buf, length);
+}
+
+void sendBlockMsg(UInt fd, BlockMsg *block_msg)
+{
+    uint8_t *buf = reserveMsg(fd, 41 + block_msg->number + block_msg->length);
+    uint8_t *p = buf;
+    *p++ = MSG_BLOCK;
+    p = putVarint(p, block_msg->id);
+    p = putDelta(p, block_msg->address, &delta_state.address);
+    p = putVarint(p, block_msg->number);
+    p = putVarint(p, block_msg->length);
+    VG_(memcpy)((void*)p, (void*)block_msg->lengths, block_msg->number);
+    p += block_msg->number;
+    VG_(memcpy)((void*)p, (void*)block_msg->code, block_msg->length);
+    p += block_msg->length;
+    commitMsg(fd, buf, p - buf);
 }
 
 void sendExecMsg(UInt fd, ExecMsg *exec_msg)
 {
-    if (traceBblock(exec_msg->exec_id) && trace_instr)
+    if (traceBblock(exec_msg->exec_id) && trace_instr && protocol_version >= 3)
+    {
+        uint8_t *buf = reserveMsg(fd, 41);
+        uint8_t *p = buf;
+        *p++ = MSG_EXEC;
+        p = putDelta(p, exec_msg->exec_id, &delta_state.exec_id);
+        p = putDelta(p, exec_msg->thread_id, &delta_state.thread_id);
+        p = putVarint(p, exec_msg->block_id);
+        p = putVarint(p, exec_msg->number);
+        commitMsg(fd, buf, p - buf);
+    }
+    else if (traceBblock(exec_msg->exec_id) && trace_instr && protocol_version >= 2)
+    {
+        uint8_t *buf = reserveMsg(fd, 51 + exec_msg->number + exec_msg->length);
+        uint8_t *p = buf;
+        *p++ = MSG_EXEC;
+        p = putDelta(p, exec_msg->exec_id, &delta_state.exec_id);
+        p = putDelta(p, exec_msg->thread_id, &delta_state.thread_id);
+        p = putVarint(p, exec_msg->number);
+        p = putVarint(p, exec_msg->length);
+        p = putDelta(p, exec_msg->addresses[0], &delta_state.address);
+        VG_(memcpy)((void*)p, (void*)exec_msg->lengths, exec_msg->number);
+        p += exec_msg->number;
+        VG_(memcpy)((void*)p, (void*)exec_msg->code, exec_msg->length);
+        p += exec_msg->length;
+        commitMsg(fd, buf, p - buf);
+    }
+    else if (traceBblock(exec_msg->exec_id) && trace_instr)
     {
         uint8_t type = MSG_EXEC;
         uint64_t length = 41; // msg header
+        uint8_t *buf;
         length += 9*exec_msg->number + exec_msg->length;
-        VG_(memcpy)((void*)msg_buffer, &type, 1);
-        VG_(memcpy)((void*)&(msg_buffer[1]), &length, 8);
-        VG_(memcpy)((void*)&(msg_buffer[9]), &(exec_msg->exec_id), 8);
-        VG_(memcpy)((void*)&(msg_buffer[17]), &(exec_msg->thread_id), 8);
-        VG_(memcpy)((void*)&(msg_buffer[25]), &(exec_msg->number), 8);
-        VG_(memcpy)((void*)&(msg_buffer[33]), &(exec_msg->length), 8);
-        VG_(memcpy)((void*)&(msg_buffer[41]), (void*)exec_msg->addresses, 8*exec_msg->number);
-        VG_(memcpy)((void*)&(msg_buffer[41+8*exec_msg->number]), (void*)exec_msg->lengths, exec_msg->number);
-        VG_(memcpy)((void*)&(msg_buffer[41+9*exec_msg->number]), (void*)exec_msg->code, exec_msg->length);
-        VG_(write)(fd, msg_buffer, length);
+        buf = reserveMsg(fd, length);
+        VG_(memcpy)((void*)buf, &type, 1);
+        VG_(memcpy)((void*)&(buf[1]), &length, 8);
+        VG_(memcpy)((void*)&(buf[9]), &(exec_msg->exec_id), 8);
+        VG_(memcpy)((void*)&(buf[17]), &(exec_msg->thread_id), 8);
+        VG_(memcpy)((void*)&(buf[25]), &(exec_msg->number), 8);
+        VG_(memcpy)((void*)&(buf[33]), &(exec_msg->length), 8);
+        VG_(memcpy)((void*)&(buf[41]), (void*)exec_msg->addresses, 8*exec_msg->number);
+        VG_(memcpy)((void*)&(buf[41+8*exec_msg->number]), (void*)exec_msg->lengths, exec_msg->number);
+        VG_(memcpy)((void*)&(buf[41+9*exec_msg->number]), (void*)exec_msg->code, exec_msg->length);
+        commitMsg(fd, buf, length);
     }
 }
 
@@ -157,20 +313,35 @@ void sendMemoryMsg(UInt fd, MemoryMsg *memory_msg)
 {
     if ((trace_mem_read && (memory_msg->mode == MODE_READ)) || (trace_mem_write && (memory_msg->mode == MODE_WRITE)))
     {
-        if (traceBblock(memory_msg->exec_id))
+        if (traceBblock(memory_msg->exec_id) && protocol_version >= 2)
+        {
+            uint8_t *buf = reserveMsg(fd, 41 + memory_msg->length);
+            uint8_t *p = buf;
+            *p++ = MSG_MEMORY;
+            p = putDelta(p, memory_msg->exec_id, &delta_state.exec_id);
+            p = putDelta(p, memory_msg->ins_address, &delta_state.ins_address);
+            p = putVarint(p, memory_msg->length << 1 | memory_msg->mode);
+            p = putDelta(p, memory_msg->start_address, &delta_state.start_address);
+            VG_(memcpy)((void*)p, memory_msg->data, memory_msg->length);
+            p += memory_msg->length;
+            commitMsg(fd, buf, p - buf);
+        }
+        else if (traceBblock(memory_msg->exec_id))
         {
             uint8_t type = MSG_MEMORY;
             uint64_t length = 42; // msg header
+            uint8_t *buf;
             length += memory_msg->length;
-            VG_(memcpy)((void*)msg_buffer, &type, 1);
-            VG_(memcpy)((void*)&(msg_buffer[1]), &length, 8);
-            VG_(memcpy)((void*)&(msg_buffer[9]), &(memory_msg->exec_id), 8);
-            VG_(memcpy)((void*)&(msg_buffer[17]), &(memory_msg->ins_address), 8);
-            VG_(memcpy)((void*)&(msg_buffer[25]), &(memory_msg->mode), 1);
-            VG_(memcpy)((void*)&(msg_buffer[26]), &(memory_msg->start_address), 8);
-            VG_(memcpy)((void*)&(msg_buffer[34]), &(memory_msg->length), 8);
-            VG_(memcpy)((void*)&(msg_buffer[42]), memory_msg->data, length-42);
-            VG_(write)(fd, msg_buffer, length);
+            buf = reserveMsg(fd, length);
+            VG_(memcpy)((void*)buf, &type, 1);
+            VG_(memcpy)((void*)&(buf[1]), &length, 8);
+            VG_(memcpy)((void*)&(buf[9]), &(memory_msg->exec_id), 8);
+            VG_(memcpy)((void*)&(buf[17]), &(memory_msg->ins_address), 8);
+            VG_(memcpy)((void*)&(buf[25]), &(memory_msg->mode), 1);
+            VG_(memcpy)((void*)&(buf[26]), &(memory_msg->start_address), 8);
+            VG_(memcpy)((void*)&(buf[34]), &(memory_msg->length), 8);
+            VG_(memcpy)((void*)&(buf[42]), memory_msg->data, length-42);
+            commitMsg(fd, buf, length);
         }
     }
 }
@@ -179,12 +350,23 @@ void sendThreadMsg(UInt fd, ThreadMsg *thread_msg)
 {
     uint8_t type = MSG_THREAD;
     uint64_t length = 26; // msg header
-    VG_(memcpy)((void*)msg_buffer, &type, 1);
-    VG_(memcpy)((void*)&(msg_buffer[1]), &length, 8);
-    VG_(memcpy)((void*)&(msg_buffer[9]), &(thread_msg->exec_id), 8);
-    VG_(memcpy)((void*)&(msg_buffer[17]), &(thread_msg->thread_id), 8);
-    VG_(memcpy)((void*)&(msg_buffer[25]), &(thread_msg->type), 1);
-    VG_(write)(fd, msg_buffer, length);
+    uint8_t *buf = reserveMsg(fd, length);
+    if (protocol_version >= 2)
+    {
+        uint8_t *p = buf;
+        *p++ = MSG_THREAD;
+        p = putDelta(p, thread_msg->exec_id, &delta_state.exec_id);
+        p = putVarint(p, thread_msg->thread_id);
+        *p++ = thread_msg->type;
+        commitMsg(fd, buf, p - buf);
+        return;
+    }
+    VG_(memcpy)((void*)buf, &type, 1);
+    VG_(memcpy)((void*)&(buf[1]), &length, 8);
+    VG_(memcpy)((void*)&(buf[9]), &(thread_msg->exec_id), 8);
+    VG_(memcpy)((void*)&(buf[17]), &(thread_msg->thread_id), 8);
+    VG_(memcpy)((void*)&(buf[25]), &(thread_msg->type), 1);
+    commitMsg(fd, buf, length);
 }
 
 
@@ -192,11 +374,32 @@ void sendThreadMsg(UInt fd, ThreadMsg *thread_msg)
 
 static void flushMemoryEvents()
 {
-    int i;
-    for(i = 0; i < memory_events_idx; i++)
-        sendMemoryMsg(trace_output_fd, &(memory_events[i]));
-    memory_events_idx = 0;
-    memory_buffer_idx = 0;
+    HWord i = 0;
+    MemoryMsg msg;
+    // exec_id only changes after a flush, all the events share it
+    msg.exec_id = exec_id;
+    while(i < mem_events_idx)
+    {
+        HWord *header = (HWord*)&(mem_events[i]);
+        msg.ins_address = header[0];
+        msg.start_address = header[1];
+        msg.length = header[2] >> 1;
+        msg.mode = header[2] & 1;
+        msg.data = &(mem_events[i + EVENT_HEADER]);
+        sendMemoryMsg(trace_output_fd, &msg);
+        i += EVENT_SIZE(msg.length);
+    }
+    mem_events_idx = 0;
+}
+
+static void freeBlockCode(BlockMsg *block)
+{
+    if(block->lengths != NULL)
+        VG_(free)(block->lengths);
+    if(block->code != NULL)
+        VG_(free)(block->code);
+    block->lengths = NULL;
+    block->code = NULL;
 }
 
 static void flushCodeEvents()
@@ -205,11 +408,22 @@ static void flushCodeEvents()
     ExecMsg msg;
     msg.exec_id = exec_id;
     msg.thread_id = thread_id;
-    msg.number = code_event_idx;
-    msg.length = code_buffer_idx;
-    msg.addresses = address_buffer;
-    msg.lengths = length_buffer;
-    msg.code = code_buffer;
+    if(protocol_version >= 3)
+    {
+        if(cur_block < 0)
+            return;
+        msg.block_id = cur_block;
+        msg.number = exec_ins;
+        cur_block = -1;
+    }
+    else
+    {
+        msg.number = code_event_idx;
+        msg.length = code_buffer_idx;
+        msg.addresses = address_buffer;
+        msg.lengths = length_buffer;
+        msg.code = code_buffer;
+    }
     sendExecMsg(trace_output_fd, &msg);
     exec_id++;
     code_buffer_idx = 0;
@@ -230,6 +444,32 @@ static VG_REGPARM(3) void instructionCallback(Addr addr, UChar delta, SizeT leng
     code_buffer_idx += length;
 }
 
+// Start of a block, the previous one is complete. exec_ins is then updated
+// by the instrumentation at each following instruction.
+static VG_REGPARM(1) void blockCallback(Word id)
+{
+    BlockDef *def;
+    flushCodeEvents();
+    // The definition goes out with the first traced execution, before the
+    // block runs: its translation may be discarded before the block completes
+    def = VG_(indexXA)(block_defs, id);
+    if(!def->sent && traceBblock(exec_id) && trace_instr)
+    {
+        // Already sent before a fork: the code is unchanged as it runs
+        if(def->msg.code == NULL)
+        {
+            def->msg.code = VG_(malloc)("tg.block.code", def->msg.length);
+            VG_(memcpy)((void*)def->msg.code, (void*)def->code_addr, def->msg.length);
+        }
+        sendBlockMsg(trace_output_fd, &def->msg);
+        VG_(free)(def->msg.code);
+        def->msg.code = NULL;
+        def->sent = True;
+    }
+    cur_block = id;
+    exec_ins = 1;
+}
+
 
 static void threadCreatedCallback(ThreadId tid, ThreadId child)
 {
@@ -259,8 +499,41 @@ static void threadExitedCallback(ThreadId tid)
     sendThreadMsg(trace_output_fd, &thread_msg);
 }
 
+// A child would write again what is still buffered: the pending events and
+// the output buffer
+static void preForkCallback(ThreadId tid)
+{
+    flushCodeEvents();
+    flushOutput(trace_output_fd);
+}
+
+// tg_fini is not called when the client calls execve, what is buffered would
+// be lost if it succeeds
+static void preSyscallCallback(ThreadId tid, UInt syscallno, UWord *args, UInt nArgs)
+{
+    if(syscallno == __NR_execve
+#if defined(__NR_execveat)
+       || syscallno == __NR_execveat
+#endif
+      )
+    {
+        flushCodeEvents();
+        flushOutput(trace_output_fd);
+    }
+}
+
+static void postSyscallCallback(ThreadId tid, UInt syscallno, UWord *args, UInt nArgs, SysRes res)
+{
+}
+
 static void threadStartedCallback(ThreadId tid, ULong block_dispatched)
 {
+    // Threads only switch between superblocks, the current block is complete
+    if(protocol_version >= 3 && tid != last_tid)
+        flushCodeEvents();
+    if(flush_on_switch && tid != last_tid)
+        flushOutput(trace_output_fd);
+    last_tid = tid;
     if(tid < MAX_THREAD)
         thread_id = thread_ids[tid];
     else
@@ -290,44 +563,202 @@ Bool traceMem(Addr a)
     return trace_mem;
 }
 
-static VG_REGPARM(3) void readCallback(Addr ins_addr, Addr start_addr, SizeT length)
+// ---- Allocation tracking ----
+// The allocator of the program runs, and is traced, as usual: the wrappers
+// of vgpreload_tracergrind (tg_preload.c) tell the tool about each block
+// through client requests. Only the blocks selected by --filter-alloc are
+// kept.
+typedef struct
 {
-    if(memory_events_idx>=MAX_MEMORY_EVENT ||
-       memory_buffer_idx + length >= MEM_BUFFER_SIZE)
-        flushMemoryEvents();
-    if (traceMem(start_addr))
+    Addr start;
+    Addr end;
+} AllocBlock;
+
+static OSet *alloc_blocks = NULL;
+
+// Text of the preload, its wrappers are not instrumented
+static Addr preload_start = 0;
+static Addr preload_end = 0;
+
+// Number of traced blocks touching each page, hashed. Accesses to a page
+// without any are rejected without looking the block up.
+#define ALLOC_PAGES 65536
+static UInt alloc_pages[ALLOC_PAGES];
+
+#define ALLOC_PAGE(a) (((a) >> 12) & (ALLOC_PAGES - 1))
+
+static Word cmpAllocBlock(const void *key, const void *elem)
+{
+    Addr a = *(const Addr*)key;
+    const AllocBlock *b = elem;
+    if(a < b->start)
+        return -1;
+    if(a >= b->end)
+        return 1;
+    return 0;
+}
+
+static void countAllocPages(AllocBlock *b, Int delta)
+{
+    Addr p;
+    SizeT n = 0;
+    for(p = b->start >> 12; p <= (b->end - 1) >> 12 && n < ALLOC_PAGES; p++, n++)
+        alloc_pages[p & (ALLOC_PAGES - 1)] += delta;
+}
+
+// The call site is the return address of the call to the allocator, the
+// client request comes from its wrapper
+static Addr allocSite(ThreadId tid)
+{
+    Addr ips[2];
+    if(VG_(get_StackTrace)(tid, ips, 2, NULL, NULL, 0) < 2)
+        return 0;
+    return ips[1] + 1;
+}
+
+static Bool selectAlloc(ThreadId tid, SizeT size)
+{
+    Int j;
+    Bool size_ok = filter_alloc_size_number == 0;
+    Bool site_ok = filter_alloc_site_number == 0;
+    Addr site;
+
+    if(filter_alloc_number == 0 || size == 0)
+        return False;
+    for(j = 0; j < filter_alloc_size_number; j++)
+        if(filter_alloc_size_min[j] <= size && filter_alloc_size_max[j] >= size)
+            size_ok = True;
+    if(!size_ok)
+        return False;
+    if(!site_ok)
     {
-        MemoryMsg *msg = &(memory_events[memory_events_idx]);
-        msg->exec_id = exec_id;
-        msg->ins_address = ins_addr;
-        msg->mode = MODE_READ;
-        msg->start_address = start_addr;
-        msg->length = length;
-        msg->data = &(memory_buffer[memory_buffer_idx]);
-        VG_(memcpy)((void*)&(memory_buffer[memory_buffer_idx]), (void*)start_addr, length);
-        memory_events_idx++;
-        memory_buffer_idx += length;
+        site = allocSite(tid);
+        for(j = 0; j < filter_alloc_site_number; j++)
+            if(filter_alloc_site[j] == site)
+                site_ok = True;
     }
+    return site_ok;
 }
 
-static VG_REGPARM(3) void writeCallback(Addr ins_addr, Addr start_addr, SizeT length)
+// Returns the size of the block at p, 0 if it wasn't traced
+static SizeT removeBlock(Addr p)
 {
-    if(memory_events_idx>=MAX_MEMORY_EVENT ||
-       memory_buffer_idx + length >= MEM_BUFFER_SIZE)
-        flushMemoryEvents();
-    if (traceMem(start_addr))
+    SizeT size;
+    AllocBlock *b = VG_(OSetGen_Lookup)(alloc_blocks, &p);
+    if(b == NULL || b->start != p)
+        return 0;
+    b = VG_(OSetGen_Remove)(alloc_blocks, &p);
+    size = b->end - b->start;
+    countAllocPages(b, -1);
+    VG_(OSetGen_FreeNode)(alloc_blocks, b);
+    return size;
+}
+
+static void addBlock(Addr p, SizeT size)
+{
+    AllocBlock *b;
+    // Blocks freed without a wrapper (e.g. inside libc) may still be there
+    for(;;)
     {
-        MemoryMsg *msg = &(memory_events[memory_events_idx]);
-        msg->exec_id = exec_id;
-        msg->ins_address = ins_addr;
-        msg->mode = MODE_WRITE;
-        msg->start_address = start_addr;
-        msg->length = length;
-        msg->data = &(memory_buffer[memory_buffer_idx]);
-        VG_(memcpy)((void*)&(memory_buffer[memory_buffer_idx]), (void*)start_addr, length);
-        memory_events_idx++;
-        memory_buffer_idx += length;
+        VG_(OSetGen_ResetIterAt)(alloc_blocks, &p);
+        b = VG_(OSetGen_Next)(alloc_blocks);
+        if(b == NULL || b->start >= p + size)
+            break;
+        removeBlock(b->start);
     }
+    b = VG_(OSetGen_AllocNode)(alloc_blocks, sizeof(AllocBlock));
+    b->start = p;
+    b->end = p + size;
+    VG_(OSetGen_Insert)(alloc_blocks, b);
+    countAllocPages(b, 1);
+}
+
+// A traced block stays traced when realloc moves it. REALLOC_START comes
+// before the call, with the old block, REALLOC_DONE after it with the old
+// block, the new one, the new size and what REALLOC_START returned.
+static Bool tg_handle_client_request(ThreadId tid, UWord *args, UWord *ret)
+{
+    if(!VG_IS_TOOL_USERREQ('T', 'G', args[0]))
+        return False;
+    *ret = 0;
+    if(filter_alloc_number == 0)
+        return True;
+    switch(args[0])
+    {
+        case VG_USERREQ__TG_MALLOC:
+            if(args[1] != 0 && selectAlloc(tid, args[2]))
+                addBlock(args[1], args[2]);
+            break;
+        case VG_USERREQ__TG_FREE:
+            if(args[1] != 0)
+                removeBlock(args[1]);
+            break;
+        case VG_USERREQ__TG_REALLOC_START:
+            if(args[1] != 0)
+                *ret = removeBlock(args[1]);
+            break;
+        case VG_USERREQ__TG_REALLOC_DONE:
+            if(args[2] != 0 && (args[4] != 0 || selectAlloc(tid, args[3])))
+                addBlock(args[2], args[3]);
+            // Failed, the old block is still there
+            else if(args[2] == 0 && args[3] != 0 && args[4] != 0)
+                addBlock(args[1], args[4]);
+            break;
+        default:
+            return False;
+    }
+    return True;
+}
+
+static Bool inTracedBlock(Addr a, SizeT length)
+{
+    Addr last = length > 0 ? a + length - 1 : a;
+    if(alloc_pages[ALLOC_PAGE(a)] == 0 && alloc_pages[ALLOC_PAGE(last)] == 0)
+        return False;
+    return VG_(OSetGen_Lookup)(alloc_blocks, &a) != NULL ||
+           VG_(OSetGen_Lookup)(alloc_blocks, &last) != NULL;
+}
+
+// Accesses between the stack pointer, minus the red zone, and the top of the
+// stack of the running thread
+static Bool onStack(Addr a, SizeT length)
+{
+    ThreadId tid = VG_(get_running_tid)();
+    return a + length > VG_(get_SP)(tid) - VG_STACK_REDZONE_SZB &&
+           a <= VG_(thread_get_stack_max)(tid);
+}
+
+static void appendMemEvent(Addr ins_addr, Addr start_addr, SizeT length, MemoryMode mode)
+{
+    HWord *header;
+    if(mem_events_idx + EVENT_SIZE(length) > sizeof(mem_events))
+        flushMemoryEvents();
+    header = (HWord*)&(mem_events[mem_events_idx]);
+    header[0] = ins_addr;
+    header[1] = start_addr;
+    header[2] = length << 1 | mode;
+    VG_(memcpy)((void*)&(mem_events[mem_events_idx + EVENT_HEADER]), (void*)start_addr, length);
+    mem_events_idx += EVENT_SIZE(length);
+}
+
+static VG_REGPARM(3) void readCallback(Addr ins_addr, Addr start_addr, SizeT length)
+{
+    if(filter_stack && onStack(start_addr, length))
+        return;
+    if(filter_alloc_number > 0 && !inTracedBlock(start_addr, length))
+        return;
+    if (traceMem(start_addr))
+        appendMemEvent(ins_addr, start_addr, length, MODE_READ);
+}
+
+static VG_REGPARM(3) void writeCallback(Addr ins_addr, Addr start_addr, SizeT length)
+{
+    if(filter_stack && onStack(start_addr, length))
+        return;
+    if(filter_alloc_number > 0 && !inTracedBlock(start_addr, length))
+        return;
+    if (traceMem(start_addr))
+        appendMemEvent(ins_addr, start_addr, length, MODE_WRITE);
 }
 
 void trackMemCallback(Addr a, SizeT len, Bool rr, Bool ww, Bool xx, ULong di_handle)
@@ -338,6 +769,12 @@ void trackMemCallback(Addr a, SizeT len, Bool rr, Bool ww, Bool xx, ULong di_han
     {
         char *filename = VG_(DebugInfo_get_filename)(di);
         char *soname = VG_(DebugInfo_get_soname)(di);
+        if(preload_end == 0 && filename != NULL &&
+           VG_(strstr)(filename, "vgpreload_tracergrind") != NULL)
+        {
+            preload_start = VG_(DebugInfo_get_text_avma)(di);
+            preload_end = preload_start + VG_(DebugInfo_get_text_size)(di);
+        }
         for(i = 0; i < filter_instr_number; i++)
         {
             if(filters_instr[i] != NULL &&
@@ -361,13 +798,20 @@ void trackMemCallback(Addr a, SizeT len, Bool rr, Bool ww, Bool xx, ULong di_han
 static void tg_print_usage(void)
 {  
     VG_(printf)(
-        "    --output=<name>           trace output file name\n"
+        "    --output=<name>           trace output file name (%%p = pid, a forked child writes <name>.<pid>)\n"
         "    --filter=<list>           list of comma separated instruction address ranges or binaries to filter (hex, eg 0x1000-0x2000)\n"
         "    --filter-mem=<list>       list of comma separated memory address ranges to filter (hex, eg 0x1000-0x2000)\n"
         "    --filter-bblock=<list>    list of comma separated basic block ranges to filter (dec, eg 1000-2000)\n"
+        "    --filter-alloc=<list>     only trace memory accesses to heap blocks of these comma separated sizes\n"
+        "                              or size ranges (dec, eg 32,16-64) and allocated from these call sites\n"
+        "                              (return address of the call, eg @0x400abc)\n"
         "    --trace-instr=<yes|no>    trace instructions (default = yes, required for sqlitetrace/tracegraph)\n"
         "    --trace-memread=<yes|no>  trace memory reads (default = yes)\n"
         "    --trace-memwrite=<yes|no> trace memory writes (default = yes)\n"
+        "    --protocol=<1|2|3>        version of the trace format, 1 or 2 for older readers (default = 3)\n"
+        "    --output-buffer=<KB>      size of the output buffer, written when full (default = 8192, 0 = no buffer)\n"
+        "    --flush-on-switch=<yes|no> also write the output buffer at each thread switch (default = yes)\n"
+        "    --filter-stack=<yes|no>   do not trace accesses to the stack of the thread (default = no)\n"
     );
 }
 
@@ -410,9 +854,25 @@ static Bool tg_process_cmd_line_option(const HChar* arg)
         }
         filter_bblock_number = i;
     }
+    else if VG_STR_CLO(arg, "--filter-alloc", filter_alloc_str)
+    {
+        int i;
+        filters_alloc[0] = VG_(strtok)(filter_alloc_str, ",");
+        for(i = 1; i<MAX_FILTER; i++)
+        {
+            filters_alloc[i] = VG_(strtok)(NULL, ",");
+            if(filters_alloc[i] == NULL)
+                break;
+        }
+        filter_alloc_number = i;
+    }
     else if VG_BOOL_CLO(arg, "--trace-instr", trace_instr) {}
     else if VG_BOOL_CLO(arg, "--trace-memread", trace_mem_read) {}
     else if VG_BOOL_CLO(arg, "--trace-memwrite", trace_mem_write) {}
+    else if VG_BOOL_CLO(arg, "--filter-stack", filter_stack) {}
+    else if VG_BINT_CLO(arg, "--protocol", protocol_version, 1, PROTOCOL_VERSION) {}
+    else if VG_BINT_CLO(arg, "--output-buffer", output_buffer_kb, 0, 1024*1024) {}
+    else if VG_BOOL_CLO(arg, "--flush-on-switch", flush_on_switch) {}
     else
         return False;
     return True;
@@ -425,26 +885,14 @@ static void tg_print_debug_usage(void)
    );
 }
 
-static void tg_post_clo_init(void)
+static void openOutput(const HChar *filename)
 {
     SysRes sres;
-    VexArch vex_arch;
-    VexArchInfo vex_arch_info;
-    InfoMsg msg;
-    char* buffer[INFO_BUFFER_SIZE];
-    char *start, *end;
-    int i;
-
-    if(trace_output_filename == 0)
-    {
-        tg_print_usage();
-        VG_(exit)(1);
-    }
-    sres = VG_(open)(trace_output_filename, VKI_O_CREAT|VKI_O_TRUNC|VKI_O_WRONLY|VKI_O_LARGEFILE,
-                                                VKI_S_IRUSR|VKI_S_IWUSR|VKI_S_IRGRP|VKI_S_IWGRP);
+    sres = VG_(open)(filename, VKI_O_CREAT|VKI_O_TRUNC|VKI_O_WRONLY|VKI_O_LARGEFILE,
+                               VKI_S_IRUSR|VKI_S_IWUSR|VKI_S_IRGRP|VKI_S_IWGRP);
     if(sr_isError(sres))
     {
-        VG_(umsg)("Error: cannot create trace file %s\n", trace_output_filename);
+        VG_(umsg)("Error: cannot create trace file %s\n", filename);
         VG_(exit)(2);
     }
     else
@@ -452,10 +900,26 @@ static void tg_post_clo_init(void)
         trace_output_fd = sr_Res(sres);
     }
     tl_assert(trace_output_fd);
+}
+
+// The INFO messages every trace file starts with
+static void sendHeader(void)
+{
+    VexArch vex_arch;
+    VexArchInfo vex_arch_info;
+    InfoMsg msg;
+    HChar protocol_str[8];
+    static HChar buffer[INFO_BUFFER_SIZE];
+    int i;
 
-    for(i = 0; i<MAX_THREAD; i++)
-        thread_ids[i] = 0;
     VG_(machine_get_VexArchInfo)(&vex_arch, &vex_arch_info);
+    if(protocol_version >= 2)
+    {
+        VG_(sprintf)(protocol_str, "%d", (Int)protocol_version);
+        msg.key = STR_PROTOCOL;
+        msg.value = protocol_str;
+        sendInfoMsg(trace_output_fd, &msg);
+    }
     msg.key = STR_TRACERGRIND_VERSION;
     msg.value = VERSION;
     sendInfoMsg(trace_output_fd, &msg);
@@ -466,6 +930,7 @@ static void tg_post_clo_init(void)
     msg.value = VG_(args_the_exename);
     sendInfoMsg(trace_output_fd, &msg);
     msg.key = STR_ARGS;
+    buffer[0] = '\0';
     for(i = 0; i < VG_(sizeXA)(VG_(args_for_client)); i++)
     {
         if(i != 0)
@@ -474,6 +939,54 @@ static void tg_post_clo_init(void)
     }
     msg.value = buffer;
     sendInfoMsg(trace_output_fd, &msg);
+}
+
+// A forked child writes its own trace, to --output with %p expanded or,
+// without %p, to --output.<pid>. Sharing the parent's file would mix two
+// streams of deltas and two sets of block IDs. The child starts from fresh
+// deltas and defines its blocks again.
+static void postForkChildCallback(ThreadId tid)
+{
+    HChar *format, *filename;
+    Word i;
+
+    VG_(close)(trace_output_fd);
+    format = VG_(malloc)("tg.child_output", VG_(strlen)(trace_output_filename) + 4);
+    VG_(strcpy)(format, trace_output_filename);
+    if(VG_(strstr)(format, "%p") == NULL)
+        VG_(strcat)(format, ".%p");
+    filename = VG_(expand_file_name)("--output", format);
+    openOutput(filename);
+    VG_(free)(filename);
+    VG_(free)(format);
+    VG_(memset)(&delta_state, 0, sizeof(delta_state));
+    for(i = 0; i < VG_(sizeXA)(block_defs); i++)
+        ((BlockDef*)VG_(indexXA)(block_defs, i))->sent = False;
+    sendHeader();
+}
+
+static void tg_post_clo_init(void)
+{
+    HChar *filename;
+    char *start, *end;
+    int i;
+
+    if(trace_output_filename == 0)
+    {
+        tg_print_usage();
+        VG_(exit)(1);
+    }
+    filename = VG_(expand_file_name)("--output", trace_output_filename);
+    openOutput(filename);
+    VG_(free)(filename);
+    out_buffer_size = output_buffer_kb * 1024;
+    if(out_buffer_size > 0)
+        out_buffer = VG_(malloc)("tg.out_buffer", out_buffer_size);
+    VG_(atfork)(preForkCallback, NULL, postForkChildCallback);
+
+    for(i = 0; i<MAX_THREAD; i++)
+        thread_ids[i] = 0;
+    sendHeader();
     for(i = 0; i < filter_instr_number; i++)
     {
         start = VG_(strstr)(filters_instr[i], "0x");
@@ -515,6 +1028,229 @@ static void tg_post_clo_init(void)
             filters_bblock[i] = NULL;
         }
     }
+    for(i = 0; i < filter_alloc_number; i++)
+    {
+        if(filters_alloc[i][0] == '@')
+        {
+            start = VG_(strstr)(filters_alloc[i], "0x");
+            if(start != NULL)
+            {
+                filter_alloc_site[filter_alloc_site_number] = VG_(strtoull16)(&(start[2]), NULL);
+                if (VG_(clo_verbosity) > 0)
+                    VG_(umsg)("Tracing heap blocks allocated from 0x%016llx\n",
+                              (Addr64) filter_alloc_site[filter_alloc_site_number]);
+                filter_alloc_site_number++;
+            }
+        }
+        else
+        {
+            end = VG_(strstr)(filters_alloc[i],"-");
+            filter_alloc_size_min[filter_alloc_size_number] = VG_(strtoull10)(filters_alloc[i], NULL);
+            filter_alloc_size_max[filter_alloc_size_number] = end != NULL ?
+                VG_(strtoull10)(&(end[1]), NULL) : filter_alloc_size_min[filter_alloc_size_number];
+            if (VG_(clo_verbosity) > 0)
+                VG_(umsg)("Tracing heap blocks of %llu to %llu bytes\n",
+                          (ULong) filter_alloc_size_min[filter_alloc_size_number],
+                          (ULong) filter_alloc_size_max[filter_alloc_size_number]);
+            filter_alloc_size_number++;
+        }
+        filters_alloc[i] = NULL;
+    }
+}
+
+// With --filter-stack, temporaries holding the stack pointer plus or minus a
+// constant: the accesses through them are not instrumented at all
+static void trackSpTmp(Bool *sp_tmps, IRTemp tmp, IRExpr *e, Int offset_SP)
+{
+    if(e->tag == Iex_Get)
+        sp_tmps[tmp] = e->Iex.Get.offset == offset_SP;
+    else if(e->tag == Iex_Binop &&
+            (e->Iex.Binop.op == Iop_Add32 || e->Iex.Binop.op == Iop_Add64 ||
+             e->Iex.Binop.op == Iop_Sub32 || e->Iex.Binop.op == Iop_Sub64) &&
+            e->Iex.Binop.arg1->tag == Iex_RdTmp &&
+            sp_tmps[e->Iex.Binop.arg1->Iex.RdTmp.tmp] &&
+            e->Iex.Binop.arg2->tag == Iex_Const)
+        sp_tmps[tmp] = True;
+}
+
+static Bool isSpTmp(Bool *sp_tmps, IRExpr *addr)
+{
+    return sp_tmps != NULL && addr->tag == Iex_RdTmp && sp_tmps[addr->Iex.RdTmp.tmp];
+}
+
+// Accesses of these types are captured by addMemEvent, the others go through
+// readCallback/writeCallback
+static Bool inlineMemType(IRType ty)
+{
+    Int size;
+    if(ty == Ity_I1)
+        return False;
+    size = sizeofIRType(ty);
+    return size == 1 || size == 2 || size == 4 || size == 8 || size == 16;
+}
+
+static void storeEventField(IRSB *sbOut, IRTemp base, HWord offset, IRExpr *value)
+{
+    IRTemp addr = newIRTemp(sbOut->tyenv, sizeof(HWord) == 8 ? Ity_I64 : Ity_I32);
+    addStmtToIRSB(sbOut, IRStmt_WrTmp(addr, IRExpr_Binop(sizeof(HWord) == 8 ? Iop_Add64 : Iop_Add32,
+                                                         IRExpr_RdTmp(base), mkIRExpr_HWord(offset))));
+    addStmtToIRSB(sbOut, IRStmt_Store(END, IRExpr_RdTmp(addr), value));
+}
+
+// Appends a memory event to mem_events with straight-line IR, data being the
+// loaded or stored value. The only call left is the flush of a full buffer.
+static void addMemEvent(IRSB *sbOut, Addr64 ins_addr, IRExpr *addr, IRExpr *data, MemoryMode mode)
+{
+    IRType ty = sizeof(HWord) == 8 ? Ity_I64 : Ity_I32;
+    IROp add = sizeof(HWord) == 8 ? Iop_Add64 : Iop_Add32;
+    IRExpr *idx_addr = mkIRExpr_HWord((HWord)&mem_events_idx);
+    HWord length = sizeofIRType(typeOfIRExpr(sbOut->tyenv, data));
+    IRTemp idx = newIRTemp(sbOut->tyenv, ty);
+    IRTemp full = newIRTemp(sbOut->tyenv, Ity_I1);
+    IRTemp base = newIRTemp(sbOut->tyenv, ty);
+    IRTemp next = newIRTemp(sbOut->tyenv, ty);
+    IRDirty *di;
+
+    addStmtToIRSB(sbOut, IRStmt_WrTmp(idx, IRExpr_Load(END, ty, idx_addr)));
+    addStmtToIRSB(sbOut, IRStmt_WrTmp(full, IRExpr_Binop(sizeof(HWord) == 8 ? Iop_CmpLT64U : Iop_CmpLT32U,
+                                                         mkIRExpr_HWord(MEM_BUFFER_SIZE),
+                                                         IRExpr_RdTmp(idx))));
+    di = unsafeIRDirty_0_N(0, "flushMemoryEvents",
+                           VG_(fnptr_to_fnentry)(&flushMemoryEvents),
+                           mkIRExprVec_0());
+    di->guard = IRExpr_RdTmp(full);
+    // mem_events_idx has to be loaded again after it
+    di->mFx = Ifx_Modify;
+    di->mAddr = idx_addr;
+    di->mSize = sizeof(HWord);
+    addStmtToIRSB(sbOut, IRStmt_Dirty(di));
+    idx = newIRTemp(sbOut->tyenv, ty);
+    addStmtToIRSB(sbOut, IRStmt_WrTmp(idx, IRExpr_Load(END, ty, idx_addr)));
+    addStmtToIRSB(sbOut, IRStmt_WrTmp(base, IRExpr_Binop(add, IRExpr_RdTmp(idx),
+                                                         mkIRExpr_HWord((HWord)mem_events))));
+    addStmtToIRSB(sbOut, IRStmt_Store(END, IRExpr_RdTmp(base), mkIRExpr_HWord((HWord)ins_addr)));
+    storeEventField(sbOut, base, sizeof(HWord), addr);
+    storeEventField(sbOut, base, 2 * sizeof(HWord), mkIRExpr_HWord(length << 1 | mode));
+    storeEventField(sbOut, base, EVENT_HEADER, data);
+    addStmtToIRSB(sbOut, IRStmt_WrTmp(next, IRExpr_Binop(add, IRExpr_RdTmp(idx),
+                                                         mkIRExpr_HWord(EVENT_SIZE(length)))));
+    addStmtToIRSB(sbOut, IRStmt_Store(END, idx_addr, IRExpr_RdTmp(next)));
+}
+
+// With --trace-instr=no, exec_id still separates the memory events of
+// consecutive blocks: pending events are flushed and exec_id incremented
+// inline, as flushCodeEvents would do
+static void addBlockBoundary(IRSB *sbOut)
+{
+    IRType ty = sizeof(HWord) == 8 ? Ity_I64 : Ity_I32;
+    IRExpr *idx_addr = mkIRExpr_HWord((HWord)&mem_events_idx);
+    IRExpr *id_addr = mkIRExpr_HWord((HWord)&exec_id);
+    IRTemp idx = newIRTemp(sbOut->tyenv, ty);
+    IRTemp pending = newIRTemp(sbOut->tyenv, Ity_I1);
+    IRTemp id = newIRTemp(sbOut->tyenv, Ity_I64);
+    IRTemp next = newIRTemp(sbOut->tyenv, Ity_I64);
+    IRDirty *di;
+
+    addStmtToIRSB(sbOut, IRStmt_WrTmp(idx, IRExpr_Load(END, ty, idx_addr)));
+    addStmtToIRSB(sbOut, IRStmt_WrTmp(pending, IRExpr_Binop(sizeof(HWord) == 8 ? Iop_CmpNE64 : Iop_CmpNE32,
+                                                            IRExpr_RdTmp(idx), mkIRExpr_HWord(0))));
+    di = unsafeIRDirty_0_N(0, "flushMemoryEvents",
+                           VG_(fnptr_to_fnentry)(&flushMemoryEvents),
+                           mkIRExprVec_0());
+    di->guard = IRExpr_RdTmp(pending);
+    di->mFx = Ifx_Modify;
+    di->mAddr = idx_addr;
+    di->mSize = sizeof(HWord);
+    addStmtToIRSB(sbOut, IRStmt_Dirty(di));
+    addStmtToIRSB(sbOut, IRStmt_WrTmp(id, IRExpr_Load(END, Ity_I64, id_addr)));
+    addStmtToIRSB(sbOut, IRStmt_WrTmp(next, IRExpr_Binop(Iop_Add64, IRExpr_RdTmp(id),
+                                                         IRExpr_Const(IRConst_U64(1)))));
+    addStmtToIRSB(sbOut, IRStmt_Store(END, id_addr, IRExpr_RdTmp(next)));
+}
+
+// Defines the block of contiguous instructions starting at the IMark
+// sbIn->stmts[i], the code is copied now as it may change later (the
+// translation is then discarded and the new one gets new blocks)
+static Word defineBlock(IRSB *sbIn, Int i, UInt *number)
+{
+    BlockDef def;
+    BlockMsg *block = &def.msg;
+    Int j;
+    UInt n = 0, length = 0;
+    Addr64 next = 0;
+
+    for(j = i; j < sbIn->stmts_used; j++)
+    {
+        IRStmt *st = sbIn->stmts[j];
+        if(st->tag != Ist_IMark)
+            continue;
+        if(n > 0 && st->Ist.IMark.addr + st->Ist.IMark.delta != next)
+            break;
+        next = st->Ist.IMark.addr + st->Ist.IMark.delta + st->Ist.IMark.len;
+        length += st->Ist.IMark.len;
+        n++;
+    }
+    block->id = VG_(sizeXA)(block_defs);
+    block->address = sbIn->stmts[i]->Ist.IMark.addr + sbIn->stmts[i]->Ist.IMark.delta;
+    block->number = n;
+    block->length = length;
+    block->lengths = VG_(malloc)("tg.block.lengths", n);
+    block->code = VG_(malloc)("tg.block.code", length);
+    length = 0;
+    for(j = i, n = 0; n < block->number; j++)
+    {
+        IRStmt *st = sbIn->stmts[j];
+        if(st->tag != Ist_IMark)
+            continue;
+        block->lengths[n++] = st->Ist.IMark.len;
+        VG_(memcpy)((void*)&(block->code[length]), (void*)(Addr)st->Ist.IMark.addr, st->Ist.IMark.len);
+        length += st->Ist.IMark.len;
+    }
+    def.code_addr = (Addr)sbIn->stmts[i]->Ist.IMark.addr;
+    def.sent = False;
+    VG_(addToXA)(block_defs, &def);
+    *number = block->number;
+    return block->id;
+}
+
+// Remembers the blocks of the superblock at addr, for tg_discard_superblock_info.
+// A superblock can be translated again without being discarded (e.g.
+// translations not kept), the blocks of every translation are kept.
+static void recordSbBlocks(Addr addr, Word first, Word count)
+{
+    BlockRange range;
+    SbBlocks *sb = VG_(OSetGen_Lookup)(sb_blocks, &addr);
+    if(sb == NULL)
+    {
+        sb = VG_(OSetGen_AllocNode)(sb_blocks, sizeof(SbBlocks));
+        sb->addr = addr;
+        sb->translations = VG_(newXA)(VG_(malloc), "tg.sb_blocks.translations",
+                                      VG_(free), sizeof(BlockRange));
+        VG_(OSetGen_Insert)(sb_blocks, sb);
+    }
+    range.first = first;
+    range.count = count;
+    VG_(addToXA)(sb->translations, &range);
+}
+
+static void tg_discard_superblock_info(Addr orig_addr, VexGuestExtents vge)
+{
+    Addr addr = vge.base[0];
+    Word i, j;
+    SbBlocks *sb = VG_(OSetGen_Remove)(sb_blocks, &addr);
+    if(sb == NULL)
+        return;
+    for(i = 0; i < VG_(sizeXA)(sb->translations); i++)
+    {
+        BlockRange *range = VG_(indexXA)(sb->translations, i);
+        for(j = 0; j < range->count; j++)
+        {
+            BlockDef *def = VG_(indexXA)(block_defs, range->first + j);
+            freeBlockCode(&def->msg);
+        }
+    }
+    VG_(deleteXA)(sb->translations);
+    VG_(OSetGen_FreeNode)(sb_blocks, sb);
 }
 
 static IRSB* tg_instrument(VgCallbackClosure* closure,
@@ -528,8 +1264,14 @@ static IRSB* tg_instrument(VgCallbackClosure* closure,
     Int        i, j;
     IRSB*      sbOut;
     IRExpr **argv, *arg1, *arg2, *arg3;
-    Addr64 last_addr;
-    Bool trace_instr = False;
+    Addr64 last_addr, next_addr = 0;
+    Bool in_filter = False, instrument;
+    Bool *sp_tmps = NULL;
+    Word first_block = -1, block;
+    UInt block_left = 0, block_ins = 0;
+    // Without filters needing a check at run time, plain loads and stores are
+    // captured inline
+    Bool inline_mem = !filter_stack && filter_alloc_number == 0 && filter_mem_number == 0;
     if (gWordTy != hWordTy)
     {
         VG_(tool_panic)("host/guest word size mismatch");
@@ -546,18 +1288,56 @@ static IRSB* tg_instrument(VgCallbackClosure* closure,
         i++;
     }
     if(filter_instr_number == 0)
-        trace_instr = True;
+        in_filter = True;
     else
         for(j = 0; j < filter_instr_number; j++)
             if(filter_instr_start[j] <= sbIn->stmts[i]->Ist.IMark.addr &&
                filter_instr_end[j] >= sbIn->stmts[i]->Ist.IMark.addr)
-                trace_instr = True;
+                in_filter = True;
+    // The allocator wrappers are not part of the program
+    if(sbIn->stmts[i]->Ist.IMark.addr >= preload_start &&
+       sbIn->stmts[i]->Ist.IMark.addr < preload_end)
+        in_filter = False;
+    // Only what the enabled options need is inserted, what is not traced
+    // costs nothing
+    instrument = in_filter && (trace_instr || trace_mem_read || trace_mem_write);
+    if(filter_stack && instrument && (trace_mem_read || trace_mem_write))
+        sp_tmps = VG_(calloc)("tg.instrument.sp_tmps", sbIn->tyenv->types_used, sizeof(Bool));
     for(; i < sbIn->stmts_used; i++)
     {
         IRStmt* st = sbIn->stmts[i];
-        if(trace_instr == True)
+        if(sp_tmps != NULL && st->tag == Ist_WrTmp)
+            trackSpTmp(sp_tmps, st->Ist.WrTmp.tmp, st->Ist.WrTmp.data, layout->offset_SP);
+        if(instrument)
         {
-            if(st->tag == Ist_IMark)
+            if(st->tag == Ist_IMark && !trace_instr)
+            {
+                last_addr = st->Ist.IMark.addr;
+                if(st->Ist.IMark.addr + st->Ist.IMark.delta != next_addr)
+                    addBlockBoundary(sbOut);
+                next_addr = st->Ist.IMark.addr + st->Ist.IMark.delta + st->Ist.IMark.len;
+            }
+            else if(st->tag == Ist_IMark && protocol_version >= 3)
+            {
+                last_addr = st->Ist.IMark.addr;
+                if(block_left == 0)
+                {
+                    block = defineBlock(sbIn, i, &block_left);
+                    if(first_block < 0)
+                        first_block = block;
+                    argv = mkIRExprVec_1(mkIRExpr_HWord((HWord)block));
+                    di = unsafeIRDirty_0_N(1, "blockCallback",
+                                           VG_(fnptr_to_fnentry)(&blockCallback),
+                                           argv);
+                    addStmtToIRSB(sbOut, IRStmt_Dirty(di));
+                    block_ins = 1;
+                }
+                else
+                    addStmtToIRSB(sbOut, IRStmt_Store(END, mkIRExpr_HWord((HWord)&exec_ins),
+                                                      IRExpr_Const(IRConst_U32(++block_ins))));
+                block_left--;
+            }
+            else if(st->tag == Ist_IMark)
             {
                 last_addr = st->Ist.IMark.addr;
                 arg1 = mkIRExpr_HWord((HWord)st->Ist.IMark.addr);
@@ -569,7 +1349,8 @@ static IRSB* tg_instrument(VgCallbackClosure* closure,
                                        argv);
                 addStmtToIRSB(sbOut, IRStmt_Dirty(di));
             }
-            else if(st->tag == Ist_LoadG)
+            else if(trace_mem_read && st->tag == Ist_LoadG &&
+                    !isSpTmp(sp_tmps, st->Ist.LoadG.details->addr))
             {
                 arg1 = mkIRExpr_HWord((HWord)last_addr);
                 if(st->Ist.LoadG.details->cvt == ILGop_Ident32)
@@ -589,9 +1370,9 @@ static IRSB* tg_instrument(VgCallbackClosure* closure,
                 di->guard = st->Ist.LoadG.details->guard;
                 addStmtToIRSB(sbOut, IRStmt_Dirty(di));
             }
-            else if(st->tag == Ist_LLSC)
+            else if(trace_mem_read && st->tag == Ist_LLSC)
             {
-                if(st->Ist.LLSC.storedata == NULL)
+                if(st->Ist.LLSC.storedata == NULL && !isSpTmp(sp_tmps, st->Ist.LLSC.addr))
                 {
                     arg1 = mkIRExpr_HWord((HWord)last_addr);
                     arg2 = mkIRExpr_HWord((HWord)sizeofIRType(typeOfIRTemp(sbIn->tyenv, st->Ist.LLSC.result)));
@@ -602,9 +1383,11 @@ static IRSB* tg_instrument(VgCallbackClosure* closure,
                     addStmtToIRSB(sbOut, IRStmt_Dirty(di));
                 }
             }
-            else if(st->tag == Ist_WrTmp)
+            else if(trace_mem_read && st->tag == Ist_WrTmp)
             {
-                if(st->Ist.WrTmp.data->tag == Iex_Load)
+                if(st->Ist.WrTmp.data->tag == Iex_Load &&
+                   !isSpTmp(sp_tmps, st->Ist.WrTmp.data->Iex.Load.addr) &&
+                   !(inline_mem && inlineMemType(st->Ist.WrTmp.data->Iex.Load.ty)))
                 {
                     arg1 = mkIRExpr_HWord((HWord)last_addr);
                     arg2 = mkIRExpr_HWord((HWord)sizeofIRType(st->Ist.WrTmp.data->Iex.Load.ty));
@@ -615,7 +1398,8 @@ static IRSB* tg_instrument(VgCallbackClosure* closure,
                     addStmtToIRSB(sbOut, IRStmt_Dirty(di));
                 }
             }
-            else if(st->tag == Ist_CAS)
+            else if(trace_mem_read && st->tag == Ist_CAS &&
+                    !isSpTmp(sp_tmps, st->Ist.CAS.details->addr))
             {
                 IRCAS *cas = st->Ist.CAS.details;
                 arg1 = mkIRExpr_HWord((HWord)last_addr);
@@ -633,9 +1417,22 @@ static IRSB* tg_instrument(VgCallbackClosure* closure,
         }
         // First executing the instruction then checking what was written
         addStmtToIRSB(sbOut, st);
-        if(trace_instr == True)
+        if(instrument)
         {
-            if(st->tag == Ist_StoreG)
+            if(trace_mem_read && inline_mem && st->tag == Ist_WrTmp &&
+               st->Ist.WrTmp.data->tag == Iex_Load &&
+               inlineMemType(st->Ist.WrTmp.data->Iex.Load.ty))
+            {
+                addMemEvent(sbOut, last_addr, st->Ist.WrTmp.data->Iex.Load.addr,
+                            IRExpr_RdTmp(st->Ist.WrTmp.tmp), MODE_READ);
+            }
+            else if(trace_mem_write && inline_mem && st->tag == Ist_Store &&
+                    inlineMemType(typeOfIRExpr(sbIn->tyenv, st->Ist.Store.data)))
+            {
+                addMemEvent(sbOut, last_addr, st->Ist.Store.addr, st->Ist.Store.data, MODE_WRITE);
+            }
+            else if(trace_mem_write && st->tag == Ist_StoreG &&
+                    !isSpTmp(sp_tmps, st->Ist.StoreG.details->addr))
             {
                 arg1 = mkIRExpr_HWord((HWord)last_addr);
                 arg2 = mkIRExpr_HWord((HWord)sizeofIRType(typeOfIRExpr(sbIn->tyenv,st->Ist.StoreG.details->data)));
@@ -646,7 +1443,7 @@ static IRSB* tg_instrument(VgCallbackClosure* closure,
                 di->guard = st->Ist.StoreG.details->guard;
                 addStmtToIRSB(sbOut, IRStmt_Dirty(di));
             }
-            else if(st->tag == Ist_Store)
+            else if(trace_mem_write && st->tag == Ist_Store && !isSpTmp(sp_tmps, st->Ist.Store.addr))
             {
                 arg1 = mkIRExpr_HWord((HWord)last_addr);
                 arg2 = mkIRExpr_HWord((HWord)sizeofIRType(typeOfIRExpr(sbIn->tyenv,st->Ist.Store.data)));
@@ -656,7 +1453,8 @@ static IRSB* tg_instrument(VgCallbackClosure* closure,
                                        argv);
                 addStmtToIRSB(sbOut, IRStmt_Dirty(di));
             }
-            else if(st->tag == Ist_LLSC && st->Ist.LLSC.storedata != NULL)
+            else if(trace_mem_write && st->tag == Ist_LLSC && st->Ist.LLSC.storedata != NULL &&
+                    !isSpTmp(sp_tmps, st->Ist.LLSC.addr))
             {
                 arg1 = mkIRExpr_HWord((HWord)last_addr);
                 arg2 = mkIRExpr_HWord((HWord)sizeofIRType(typeOfIRExpr(sbIn->tyenv, st->Ist.LLSC.storedata)));
@@ -666,7 +1464,8 @@ static IRSB* tg_instrument(VgCallbackClosure* closure,
                                        argv);
                 addStmtToIRSB(sbOut, IRStmt_Dirty(di));
             }
-            else if(st->tag == Ist_CAS)
+            else if(trace_mem_write && st->tag == Ist_CAS &&
+                    !isSpTmp(sp_tmps, st->Ist.CAS.details->addr))
             {
                 // We treat it as an unconditional write although it's wrong
                 // The write may not have happened and the value might have been the same before
@@ -683,6 +1482,10 @@ static IRSB* tg_instrument(VgCallbackClosure* closure,
             }
         }
     }
+    if(sp_tmps != NULL)
+        VG_(free)(sp_tmps);
+    if(first_block >= 0)
+        recordSbBlocks(vge->base[0], first_block, VG_(sizeXA)(block_defs) - first_block);
     return sbOut;
 }
 
@@ -698,6 +1501,7 @@ static void tg_fini(Int exitcode)
         lib_msg.end = lib_msg.base + VG_(DebugInfo_get_text_size)(di);
         sendLibMsg(trace_output_fd, &lib_msg);
     }
+    flushOutput(trace_output_fd);
     VG_(close)(trace_output_fd);
 }
 
@@ -722,6 +1526,14 @@ static void tg_pre_clo_init(void)
    VG_(track_pre_thread_ll_exit)(threadExitedCallback);
    VG_(track_new_mem_startup)(trackMemCallback);
    VG_(track_new_mem_mmap)(trackMemCallback);
+   VG_(needs_client_requests)(tg_handle_client_request);
+   VG_(needs_superblock_discards)(tg_discard_superblock_info);
+   VG_(needs_syscall_wrapper)(preSyscallCallback, postSyscallCallback);
+   alloc_blocks = VG_(OSetGen_Create)(offsetof(AllocBlock, start), cmpAllocBlock,
+                                      VG_(malloc), "tg.alloc_blocks", VG_(free));
+   block_defs = VG_(newXA)(VG_(malloc), "tg.block_defs", VG_(free), sizeof(BlockDef));
+   sb_blocks = VG_(OSetGen_Create)(offsetof(SbBlocks, addr), NULL,
+                                   VG_(malloc), "tg.sb_blocks", VG_(free));
 }
 
 VG_DETERMINE_INTERFACE_VERSION(tg_pre_clo_init)
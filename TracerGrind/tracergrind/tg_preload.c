@@ -0,0 +1,106 @@
+/* ===================================================================== */
+/* This file is part of TracerGrind                                      */
+/* TracerGrind is an execution tracing module for Valgrind               */
+/* Copyright (C) 2016                                                    */
+/* Original author:   Charles Hubain <me@haxelion.eu>                    */
+/* Contributors:      Phil Teuwen <phil@teuwen.org>                      */
+/*                    Joppe Bos <joppe_bos@hotmail.com>                  */
+/*                    Wil Michiels <w.p.a.j.michiels@tue.nl>             */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* any later version.                                                    */
+/*                                                                       */
+/* This program is distributed in the hope that it will be useful,       */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/* GNU General Public License for more details.                          */
+/*                                                                       */
+/* You should have received a copy of the GNU General Public License     */
+/* along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+/* ===================================================================== */
+
+// Wrappers of the allocator of the program, for --filter-alloc. The real
+// functions run, and are traced, as without the tool; the wrappers, which
+// are not instrumented, report the blocks through client requests. A block
+// is reported freed before the real free so that another thread can't get
+// it first.
+
+#include "pub_tool_basics.h"
+#include "pub_tool_redir.h"
+#include "tracergrind.h"
+
+#define MALLOC_WRAPPER(fnname) \
+    void *I_WRAP_SONAME_FNNAME_ZU(VG_Z_LIBC_SONAME, fnname)(SizeT n); \
+    void *I_WRAP_SONAME_FNNAME_ZU(VG_Z_LIBC_SONAME, fnname)(SizeT n) \
+    { \
+        OrigFn fn; \
+        void *p; \
+        VALGRIND_GET_ORIG_FN(fn); \
+        CALL_FN_W_W(p, fn, n); \
+        VALGRIND_DO_CLIENT_REQUEST_STMT(VG_USERREQ__TG_MALLOC, p, n, 0, 0, 0); \
+        return p; \
+    }
+
+#define MEMALIGN_WRAPPER(fnname) \
+    void *I_WRAP_SONAME_FNNAME_ZU(VG_Z_LIBC_SONAME, fnname)(SizeT align, SizeT n); \
+    void *I_WRAP_SONAME_FNNAME_ZU(VG_Z_LIBC_SONAME, fnname)(SizeT align, SizeT n) \
+    { \
+        OrigFn fn; \
+        void *p; \
+        VALGRIND_GET_ORIG_FN(fn); \
+        CALL_FN_W_WW(p, fn, align, n); \
+        VALGRIND_DO_CLIENT_REQUEST_STMT(VG_USERREQ__TG_MALLOC, p, n, 0, 0, 0); \
+        return p; \
+    }
+
+MALLOC_WRAPPER(malloc)
+MALLOC_WRAPPER(valloc)
+MEMALIGN_WRAPPER(memalign)
+MEMALIGN_WRAPPER(aligned_alloc)
+
+void *I_WRAP_SONAME_FNNAME_ZU(VG_Z_LIBC_SONAME, calloc)(SizeT nmemb, SizeT size);
+void *I_WRAP_SONAME_FNNAME_ZU(VG_Z_LIBC_SONAME, calloc)(SizeT nmemb, SizeT size)
+{
+    OrigFn fn;
+    void *p;
+    VALGRIND_GET_ORIG_FN(fn);
+    CALL_FN_W_WW(p, fn, nmemb, size);
+    VALGRIND_DO_CLIENT_REQUEST_STMT(VG_USERREQ__TG_MALLOC, p, nmemb * size, 0, 0, 0);
+    return p;
+}
+
+int I_WRAP_SONAME_FNNAME_ZU(VG_Z_LIBC_SONAME, posix_memalign)(void **memptr, SizeT align, SizeT n);
+int I_WRAP_SONAME_FNNAME_ZU(VG_Z_LIBC_SONAME, posix_memalign)(void **memptr, SizeT align, SizeT n)
+{
+    OrigFn fn;
+    int res;
+    VALGRIND_GET_ORIG_FN(fn);
+    CALL_FN_W_WWW(res, fn, memptr, align, n);
+    if(res == 0)
+        VALGRIND_DO_CLIENT_REQUEST_STMT(VG_USERREQ__TG_MALLOC, *memptr, n, 0, 0, 0);
+    return res;
+}
+
+void *I_WRAP_SONAME_FNNAME_ZU(VG_Z_LIBC_SONAME, realloc)(void *p, SizeT n);
+void *I_WRAP_SONAME_FNNAME_ZU(VG_Z_LIBC_SONAME, realloc)(void *p, SizeT n)
+{
+    OrigFn fn;
+    void *np;
+    SizeT traced;
+    VALGRIND_GET_ORIG_FN(fn);
+    traced = VALGRIND_DO_CLIENT_REQUEST_EXPR(0, VG_USERREQ__TG_REALLOC_START, p, 0, 0, 0, 0);
+    CALL_FN_W_WW(np, fn, p, n);
+    VALGRIND_DO_CLIENT_REQUEST_STMT(VG_USERREQ__TG_REALLOC_DONE, p, np, n, traced, 0);
+    return np;
+}
+
+void I_WRAP_SONAME_FNNAME_ZU(VG_Z_LIBC_SONAME, free)(void *p);
+void I_WRAP_SONAME_FNNAME_ZU(VG_Z_LIBC_SONAME, free)(void *p)
+{
+    OrigFn fn;
+    VALGRIND_GET_ORIG_FN(fn);
+    VALGRIND_DO_CLIENT_REQUEST_STMT(VG_USERREQ__TG_FREE, p, 0, 0, 0, 0);
+    CALL_FN_v_W(fn, p);
+}
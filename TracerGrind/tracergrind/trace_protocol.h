@@ -28,7 +28,8 @@ typedef enum _MsgType
     MSG_LIB,
     MSG_EXEC,
     MSG_MEMORY,
-    MSG_THREAD
+    MSG_THREAD,
+    MSG_BLOCK
 } MsgType;
 
 typedef enum _MemoryMode
@@ -68,6 +69,7 @@ typedef struct _ExecMsg
 {
     uint64_t exec_id;
     uint64_t thread_id;
+    uint64_t block_id;  // protocol 3 only, replaces addresses, lengths and code
     uint64_t number;
     uint64_t length;
     uint64_t *addresses;
@@ -75,6 +77,16 @@ typedef struct _ExecMsg
     uint8_t *code;
 } ExecMsg;
 
+typedef struct _BlockMsg
+{
+    uint64_t id;
+    uint64_t address;
+    uint64_t number;
+    uint64_t length;
+    uint8_t *lengths;
+    uint8_t *code;
+} BlockMsg;
+
 typedef struct _MemoryMsg
 {
     uint64_t exec_id;
@@ -92,7 +104,64 @@ typedef struct _ThreadMsg
     uint8_t type;
 } ThreadMsg;
 
-static const char* STR_TRACERGRIND_VERSION = "TRACERGRIND_VERSION";
-static const char* STR_ARCH = "ARCH";
-static const char* STR_PROGRAM = "PROGRAM";
-static const char* STR_ARGS = "ARGS";
+// Arrays rather than pointers so that a writer which doesn't use all of them
+// (e.g. TracerPIN) compiles cleanly with -Wall
+static const char STR_TRACERGRIND_VERSION[] = "TRACERGRIND_VERSION";
+static const char STR_TRACERPIN_VERSION[] = "TRACERPIN_VERSION";
+static const char STR_ARCH[] = "ARCH";
+static const char STR_PROGRAM[] = "PROGRAM";
+static const char STR_ARGS[] = "ARGS";
+static const char STR_PROTOCOL[] = "PROTOCOL";
+
+// Protocol version 2 is announced by a PROTOCOL info message sent before any
+// other, traces without it are version 1. INFO and LIB messages are the same
+// in both. In version 2, EXEC, MEMORY and THREAD messages have no length
+// field and their fields are varints (LEB128), most of them zigzag encoded
+// deltas against the same field of the previous message (see DeltaState):
+//   EXEC:   type, exec_id, thread_id, number, length, address,
+//           lengths[number], code[length]
+//           only the first address is sent, the others follow from the lengths
+//   MEMORY: type, exec_id, ins_address, length << 1 | mode, start_address,
+//           data[length]
+//   THREAD: type, exec_id, thread_id (not a delta), type
+// Protocol version 3 is version 2 where the code of a block is sent once, in
+// a BLOCK message preceding its first execution, and EXEC messages only give
+// the block ID and how many of its instructions were executed:
+//   BLOCK:  type, id (not a delta), address, number, length,
+//           lengths[number], code[length]
+//   EXEC:   type, exec_id, thread_id, block_id (not a delta), number
+// address is a delta against the previous BLOCK address.
+#define PROTOCOL_VERSION 3
+
+typedef struct _DeltaState
+{
+    uint64_t exec_id;       // shared by the three messages
+    uint64_t thread_id;     // EXEC
+    uint64_t address;       // EXEC, BLOCK in version 3
+    uint64_t ins_address;   // MEMORY
+    uint64_t start_address; // MEMORY
+} DeltaState;
+
+static inline uint8_t *putVarint(uint8_t *p, uint64_t v)
+{
+    while(v >= 0x80)
+    {
+        *p++ = (uint8_t)v | 0x80;
+        v >>= 7;
+    }
+    *p++ = (uint8_t)v;
+    return p;
+}
+
+static inline uint8_t *putDelta(uint8_t *p, uint64_t v, uint64_t *prev)
+{
+    int64_t d = (int64_t)(v - *prev);
+    *prev = v;
+    return putVarint(p, ((uint64_t)d << 1) ^ (uint64_t)(d >> 63));
+}
+
+static inline uint64_t undoDelta(uint64_t z, uint64_t *prev)
+{
+    *prev += (z >> 1) ^ (0 - (z & 1));
+    return *prev;
+}
@@ -0,0 +1,37 @@
+/* ===================================================================== */
+/* This file is part of TracerGrind                                      */
+/* TracerGrind is an execution tracing module for Valgrind               */
+/* Copyright (C) 2016                                                    */
+/* Original author:   Charles Hubain <me@haxelion.eu>                    */
+/* Contributors:      Phil Teuwen <phil@teuwen.org>                      */
+/*                    Joppe Bos <joppe_bos@hotmail.com>                  */
+/*                    Wil Michiels <w.p.a.j.michiels@tue.nl>             */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* any later version.                                                    */
+/*                                                                       */
+/* This program is distributed in the hope that it will be useful,       */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/* GNU General Public License for more details.                          */
+/*                                                                       */
+/* You should have received a copy of the GNU General Public License     */
+/* along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+/* ===================================================================== */
+#ifndef __TRACERGRIND_H
+#define __TRACERGRIND_H
+
+#include "valgrind.h"
+
+// Client requests of the allocator wrappers (tg_preload.c)
+typedef enum
+{
+    VG_USERREQ__TG_MALLOC = VG_USERREQ_TOOL_BASE('T','G'),  // block, size
+    VG_USERREQ__TG_FREE,                                     // block
+    VG_USERREQ__TG_REALLOC_START,                            // old block
+    VG_USERREQ__TG_REALLOC_DONE                              // old, new, size, start result
+} Vg_TracerGrindClientRequest;
+
+#endif
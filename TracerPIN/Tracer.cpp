@@ -25,15 +25,20 @@
 #include <fstream>
 #include <sstream>
 #include <cstdlib>
+#include <cstring>
 #include <iomanip>
 #include <map>
+#include <vector>
+#include <algorithm>
 #include "sqlite3.h"
+#include "../TracerGrind/tracergrind/trace_protocol.h"
 #include <sys/time.h>
 #include <sys/syscall.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/ipc.h>
 #include <sys/shm.h>
+#include <signal.h>
 #include <stdio.h>
 #ifndef GIT_DESC
 #define GIT_DESC "(unknown version)"
@@ -51,7 +56,7 @@ typedef struct {
     char lock;
 } SharedLock;
 
-SharedLock* sharedVal;
+SharedLock* sharedVal = NULL;
 
 void attach() {
     //printf("Getting shared memory\n");
@@ -63,11 +68,19 @@ void attach() {
         return;
     }
 
-    sharedVal = (SharedLock*)shmat(shmid, NULL, 0);
+    void *addr = shmat(shmid, NULL, 0);
+    if (addr == (void *)-1) {
+        perror("shmat");
+        return;
+    }
+    sharedVal = (SharedLock*)addr;
 }
 
+// Without the segment tracing is never paused
 char get_lock() {
     
+    if (sharedVal == NULL)
+        return 0;
     char lock = sharedVal->lock;
     
     return lock;
@@ -77,6 +90,7 @@ std::ofstream TraceFile;
 std::stringstream value;
 std::string strvalue;
 PIN_LOCK lock;
+TLS_KEY tls_key;
 struct moduledata_t
 {
     BOOL excluded;
@@ -86,41 +100,186 @@ struct moduledata_t
 
 typedef std::map<string, moduledata_t> modmap_t;
 
+// Inclusive address range
+struct AddrRange
+{
+    ADDRINT begin;
+    ADDRINT end;
+};
+
+typedef std::vector<AddrRange> rangevec_t;
+
 modmap_t mod_data;
 ADDRINT main_begin;
 ADDRINT main_end;
 bool main_reached=false;
 INT64 logfilter=1;
 bool logfilterlive=false;
-ADDRINT filter_begin=0;
-ADDRINT filter_end=0;
+rangevec_t filter_ranges;
+rangevec_t mem_ranges;      // -M, sorted and merged
+ADDRINT mem_filter_lo=0;    // hull of mem_ranges
+ADDRINT mem_filter_hi=0;
+bool coverage=false;        // -v, not in binary mode
+bool filter_stack=false;    // -S
+REG stack_top_reg;          // -S, top of the thread's stack
 ADDRINT filter_live_start=0;
 ADDRINT filter_live_stop=0;
 INT32 filter_live_n=0;
 INT32 filter_live_i=0;
-bool filter_live_reached=false;
 bool quiet=false;
 long long bigcounter=0; // Ready for 4 billions of instructions
-long long currentbbl=0;
 enum InfoTypeType { T, C, B, R, I, W };
-InfoTypeType InfoType=T;
 std::string TraceName;
 sqlite3 *db;
-sqlite3_int64 bbl_id = 0, ins_id = 0;
-sqlite3_stmt *info_insert, *bbl_insert, *call_insert, *lib_insert, *ins_insert, *mem_insert, *thread_insert, *thread_update;
-
-enum LogTypeType { HUMAN, SQLITE};
+sqlite3_stmt *info_insert, *bbl_insert, *call_insert, *ret_insert, *lib_insert, *code_insert, *ins_insert, *mem_insert, *thread_insert, *thread_update;
+
+enum LogTypeType { HUMAN, SQLITE, BINARY};
+// Schema v2: addresses are INTEGER and raw bytes BLOB, the version is
+// recorded under SCHEMA_VERSION in info (v1 had no such key)
+// Schema v3: the static part of the instructions (ip, dis, op) is stored
+// once in code, ins rows only reference it
+#define SCHEMA_VERSION "3"
 static const char *SETUP_QUERY = 
 "CREATE TABLE IF NOT EXISTS info (key TEXT PRIMARY KEY, value TEXT);\n"
-"CREATE TABLE IF NOT EXISTS lib (name TEXT, base TEXT, end TEXT);\n"
-"CREATE TABLE IF NOT EXISTS bbl (addr TEXT, addr_end TEXT, size INTEGER, thread_id INTEGER);\n"
-"CREATE TABLE IF NOT EXISTS call (ins_id INTEGER, addr TEXT, name TEXT);\n"
-"CREATE TABLE IF NOT EXISTS ins (bbl_id INTEGER, ip TEXT, dis TEXT, op TEXT);\n"
-"CREATE TABLE IF NOT EXISTS mem (ins_id INTEGER, ip TEXT, type TEXT, addr TEXT, addr_end TEXT, size INTEGER, data TEXT, value TEXT);\n"
+"CREATE TABLE IF NOT EXISTS lib (name TEXT, base INTEGER, end INTEGER);\n"
+"CREATE TABLE IF NOT EXISTS bbl (addr INTEGER, size INTEGER, thread_id INTEGER);\n"
+"CREATE TABLE IF NOT EXISTS call (ins_id INTEGER, addr INTEGER, name TEXT);\n"
+"CREATE TABLE IF NOT EXISTS ret (ins_id INTEGER, addr INTEGER);\n"
+"CREATE TABLE IF NOT EXISTS profile (addr INTEGER, name TEXT, calls INTEGER, inclusive INTEGER, exclusive INTEGER);\n"
+"CREATE TABLE IF NOT EXISTS coverage (addr INTEGER, size INTEGER, ins INTEGER, count INTEGER);\n"
+"CREATE TABLE IF NOT EXISTS code (ip INTEGER, dis TEXT, op BLOB);\n"
+"CREATE TABLE IF NOT EXISTS ins (bbl_id INTEGER, code_id INTEGER);\n"
+"CREATE TABLE IF NOT EXISTS mem (ins_id INTEGER, type TEXT, addr INTEGER, size INTEGER, data BLOB);\n"
 "CREATE TABLE IF NOT EXISTS thread (thread_id INTEGER, start_bbl_id INTEGER, exit_bbl_id INTEGER);\n";
 
 LogTypeType LogType=HUMAN;
 
+// Size above which a thread hands its pending output over to the trace file
+#define THREAD_BUFFER_SIZE (4 << 20)
+// Room left above it for the record being written
+#define THREAD_BUFFER_SLACK (64 << 10)
+
+// Static part of a MSG_EXEC message (number, length, addresses, lengths
+// and code), serialized once when the basic block is instrumented
+struct ExecBlock
+{
+    ADDRINT addr;
+    std::string body;
+};
+
+// Static part of an instruction, interned once when it is instrumented
+// (see InternIns) so the analysis routines only pass a pointer to it
+struct StaticIns
+{
+    ADDRINT ip;
+    INT32 size;
+    UINT8 bytes[32];
+    std::string disass;
+    std::string text;       // human record after the ip column
+    sqlite3_int64 code_id;  // row in code, only touched by the sqlite writer
+};
+
+// Shadow call stack (-p), see ShadowCall
+struct Frame
+{
+    ADDRINT func;
+    ADDRINT sp;         // stack pointer at the matching ret
+    UINT64 entry;       // executed instructions at the call
+    UINT64 children;    // instructions spent in callees
+};
+
+struct FuncStats
+{
+    UINT64 calls;
+    UINT64 inclusive;
+    UINT64 exclusive;
+};
+
+typedef std::map<ADDRINT, FuncStats> profile_t;
+
+struct ThreadLog;
+static VOID FlushThreadLog(ThreadLog *tl);
+
+// Output buffer of a thread. The frequent text records are formatted
+// straight into it (see the text formatter), the others go through the
+// std::ostream set on top of it.
+class ThreadBuffer : public std::streambuf
+{
+  public:
+    ThreadBuffer(ThreadLog *owner) : owner(owner)
+    {
+        reset();
+    }
+    const char* begin() const { return pbase(); }
+    size_t size() const { return pptr() - pbase(); }
+    size_t avail() const { return epptr() - pptr(); }
+    char* cur() { return pptr(); }
+    VOID commit(char *p) { pbump(p - pptr()); }
+    VOID reset() { setp(data, data + sizeof(data)); }
+
+  protected:
+    // Only reached by a record larger than the slack
+    int overflow(int c)
+    {
+        FlushThreadLog(owner);
+        if (c != traits_type::eof())
+        {
+            *pptr() = c;
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+
+  private:
+    ThreadLog *owner;
+    char data[THREAD_BUFFER_SIZE + THREAD_BUFFER_SLACK];
+};
+
+// Everything the analysis routines write to lives in the ThreadLog of the
+// calling thread (PIN TLS), so they don't need the global lock. Only the
+// step counter is shared: it is advanced atomically and stamped on every
+// event, so the global order can be rebuilt from the per-thread chunks.
+struct ThreadLog
+{
+    THREADID tid;
+    PIN_THREAD_UID uid;
+    UINT64 chunk;
+    InfoTypeType InfoType;
+    long long counter;
+    long long currentbbl;
+    ADDRINT WriteAddr;
+    INT32 WriteSize;
+    const ExecBlock *pending;
+    UINT64 exec_id;
+    UINT64 executed;            // instructions, counted with -p
+    bool in_alloc;              // in a replaced allocator, with -A
+    std::vector<Frame> stack;
+    profile_t profile;
+    ThreadBuffer buf;
+    std::ostream out;
+
+    ThreadLog() : buf(this), out(&buf) {}
+};
+
+std::vector<ThreadLog*> thread_logs;
+
+// Analysis routines matching the configuration, picked once the knobs are
+// parsed (see SelectAnalysisFuns) so the instrumentation inserts them
+// without testing anything
+struct AnalysisFuns
+{
+    AFUNPTR ins;
+    AFUNPTR bbl;
+    AFUNPTR call;
+    AFUNPTR indirect_call;
+    AFUNPTR read;
+    AFUNPTR prefetch;
+    AFUNPTR write;
+    AFUNPTR ret;
+};
+
+AnalysisFuns afun;
+
 /* ===================================================================== */
 /* Commandline Switches */
 /* ===================================================================== */
@@ -138,13 +297,35 @@ KNOB<BOOL> KnobLogCall(KNOB_MODE_WRITEONCE, "pintool",
 KNOB<BOOL> KnobLogCallArgs(KNOB_MODE_WRITEONCE, "pintool",
                            "C", "0", "log all calls with their first three args");
 KNOB<string> KnobLogFilter(KNOB_MODE_WRITEONCE, "pintool",
-                        "f", "1", "(0) no filter (1) filter system libraries (2) filter all but main exec (0x400000-0x410000) trace only specified address range");
+                        "f", "1", "(0) no filter (1) filter system libraries (2) filter all but main exec (0x400000-0x410000[,...]) trace only specified address ranges");
 KNOB<string> KnobLogFilterLive(KNOB_MODE_WRITEONCE, "pintool",
                         "F", "0", "(0) no live filter (0x400000:0x410000) use addresses as start:stop live filter");
 KNOB<INT> KnobLogFilterLiveN(KNOB_MODE_WRITEONCE, "pintool",
                            "n", "0", "which occurence to log, 0=all (only for -F start:stop filter)");
+KNOB<UINT64> KnobSkip(KNOB_MODE_WRITEONCE, "pintool",
+                        "s", "0", "fast-forward: skip the first n traced instructions");
+KNOB<string> KnobEnd(KNOB_MODE_WRITEONCE, "pintool",
+                        "e", "0", "(0x400000) stop tracing when this address is reached");
+KNOB<BOOL> KnobDetach(KNOB_MODE_WRITEONCE, "pintool",
+                        "D", "0", "once tracing is over (-e, or the -n occurrence of -F), close the trace and detach");
+KNOB<string> KnobMemFilter(KNOB_MODE_WRITEONCE, "pintool",
+                        "M", "", "(0x601000-0x602000[,...]) log only memory accesses touching these data ranges");
+KNOB<UINT64> KnobBudget(KNOB_MODE_WRITEONCE, "pintool",
+                        "k", "0", "log only the first k executions of each basic block, 0=all");
+KNOB<UINT64> KnobBudgetEvery(KNOB_MODE_WRITEONCE, "pintool",
+                        "K", "0", "with -k, log one execution every K after that, 0=none");
+KNOB<string> KnobAllocFilter(KNOB_MODE_WRITEONCE, "pintool",
+                        "A", "", "(32,16-64,@0x400abc) log only memory accesses to heap blocks of these sizes and from these call sites");
+KNOB<BOOL> KnobStackFilter(KNOB_MODE_WRITEONCE, "pintool",
+                        "S", "0", "do not log memory accesses to the stack of the thread");
 KNOB<string> KnobLogType(KNOB_MODE_WRITEONCE, "pintool",
-                         "t", "human", "log type: human/sqlite");
+                         "t", "human", "log type: human/sqlite/binary/ring");
+KNOB<UINT32> KnobRingSize(KNOB_MODE_WRITEONCE, "pintool",
+                         "R", "64", "ring log type: MB of trace kept in memory");
+KNOB<BOOL> KnobProfile(KNOB_MODE_WRITEONCE, "pintool",
+                        "p", "0", "shadow call stack: log returns and write a per-function profile (not with binary/ring)");
+KNOB<BOOL> KnobCoverage(KNOB_MODE_WRITEONCE, "pintool",
+                        "v", "0", "coverage: only count the executions of each basic block (not with binary/ring)");
 KNOB<BOOL> KnobQuiet(KNOB_MODE_WRITEONCE, "pintool",
                        "q", "0", "be quiet under normal conditions");
 
@@ -193,13 +374,87 @@ extern "C" int utimes(const char *path, const struct timeval times[2])
 }
 
 /* ===================================================================== */
-/* Print Help Message                                                    */
+/* Tracing switch                                                        */
+/* ===================================================================== */
+
+// Tracing is paused while the shared lock is 1. An internal thread polls
+// it and on every change drops the code cache: while paused nothing gets
+// instrumented and the program runs without analysis calls, once resumed
+// the code is instrumented again. The analysis routines don't poll at all.
+#define CONTROL_POLL_MS 10
+
+volatile bool tracing_paused=false;
+volatile bool control_stop=false;
+bool control_running=false;
+PIN_THREAD_UID control_uid;
+
+// Drops the code cache, everything gets instrumented again
+static VOID ReInstrument()
+{
+    PIN_LockClient();
+    PIN_RemoveInstrumentation();
+    PIN_UnlockClient();
+}
+
+static VOID ControlThread(VOID *arg)
+{
+    while (!control_stop && !PIN_IsProcessExiting())
+    {
+        bool paused = (get_lock() == 1);
+        if (paused != tracing_paused)
+        {
+            tracing_paused = paused;
+            ReInstrument();
+        }
+        PIN_Sleep(CONTROL_POLL_MS);
+    }
+}
+
+/* ===================================================================== */
+/* Fast-forward (-s) and end of tracing (-e, -n, -D)                     */
 /* ===================================================================== */
-bool fileExists() {
-    return get_lock() == 1;
+
+// While fast-forwarding each traced block only subtracts its size from
+// ff_left, in an If routine PIN inlines. The Then routine runs once it
+// drops to zero and has everything instrumented again. ff_left isn't
+// updated atomically, a race can only skip a few more blocks.
+volatile bool fast_forward=false;
+INT64 ff_left=0;
+
+// Once tracing is over nothing is instrumented anymore, and with -D the
+// trace is closed and PIN detaches, leaving the program run natively
+volatile bool tracing_over=false;
+ADDRINT end_addr=0;
+
+static ADDRINT FastForwardCount(UINT32 n)
+{
+    ff_left -= n;
+    return ff_left <= 0;
+}
+
+static VOID FastForwardDone()
+{
+    if (__sync_bool_compare_and_swap(&fast_forward, true, false))
+        ReInstrument();
+}
+
+static VOID DumpRing();
+
+// In ring mode the end of tracing is a trigger
+static VOID EndTracing()
+{
+    if (! __sync_bool_compare_and_swap(&tracing_over, false, true))
+        return;
+    DumpRing();
+    if (KnobDetach.Value())
+        PIN_Detach();
+    else
+        ReInstrument();
 }
 
-#define SKIP_IF_LOCK if(fileExists()) return;
+/* ===================================================================== */
+/* Print Help Message                                                    */
+/* ===================================================================== */
 
 INT32 Usage()
 {
@@ -214,413 +469,1637 @@ INT32 Usage()
 }
 
 /* ===================================================================== */
-/* Helper Functions                                                      */
+/* Address filter index                                                  */
 /* ===================================================================== */
 
-BOOL ExcludedAddress(ADDRINT ip)
+// Sorted, disjoint ranges looked up by ExcludedAddress: the excluded
+// modules for -f 1, the main image for -f 2 and the user ranges for -f
+// ranges. It is rebuilt under the lock when images come and go and then
+// swapped in, lookups only read the current pointer. Replaced indexes are
+// kept since a lookup may still be using them, images don't come and go
+// often enough for this to matter.
+const rangevec_t * volatile filter_index = new rangevec_t();
+
+struct RangeBeginLess
+{
+    bool operator()(ADDRINT ip, const AddrRange &r) const { return ip < r.begin; }
+    bool operator()(const AddrRange &a, const AddrRange &b) const { return a.begin < b.begin; }
+};
+
+static BOOL InRanges(const rangevec_t *ranges, ADDRINT ip)
+{
+    // The candidate is the last range starting at or below ip
+    rangevec_t::const_iterator it = std::upper_bound(ranges->begin(), ranges->end(), ip, RangeBeginLess());
+    if (it == ranges->begin())
+        return FALSE;
+    --it;
+    return ip <= it->end;
+}
+
+// Sorts and merges ranges in place
+static VOID NormalizeRanges(rangevec_t &ranges)
+{
+    std::sort(ranges.begin(), ranges.end(), RangeBeginLess());
+    size_t n = 0;
+    for (size_t i = 0; i < ranges.size(); i++)
+    {
+        if (n > 0 && ranges[i].begin <= ranges[n-1].end + 1 && ranges[n-1].end + 1 != 0)
+        {
+            if (ranges[i].end > ranges[n-1].end)
+                ranges[n-1].end = ranges[i].end;
+        }
+        else
+            ranges[n++] = ranges[i];
+    }
+    ranges.resize(n);
+}
+
+// Call with the lock held
+static VOID RebuildFilterIndex()
 {
+    rangevec_t *index = new rangevec_t();
     switch (logfilter)
     {
     case 1:
-        if (! main_reached)
-        {
-	        // Filter loader before main
-	        if ((ip < main_begin) || (ip > main_end))
-	            return TRUE;
-            else
-                main_reached=true;
-		}
-        if ((ip >= main_begin) && (ip <= main_end))
-            return FALSE;
         for(modmap_t::iterator it = mod_data.begin(); it != mod_data.end(); ++it)
         {
             if(it->second.excluded == FALSE) continue;
-            /* Is the EIP value within the range of any excluded module? */
-            if(ip >= it->second.begin && ip <= it->second.end) return TRUE;
+            AddrRange r = { it->second.begin, it->second.end };
+            index->push_back(r);
         }
         break;
     case 2:
-    {
-        PIN_LockClient();
-        IMG im = IMG_FindByAddress(ip);
-        PIN_UnlockClient();
-        if (! IMG_Valid(im) || ! IMG_IsMainExecutable(im))
-            return TRUE;
+        if (main_end != 0)
+        {
+            AddrRange r = { main_begin, main_end };
+            index->push_back(r);
+        }
         break;
-    }
     case 3:
-        return ((ip < filter_begin) || (ip > filter_end));
-        break;
-    case 4: // Wasm
-        return (ip > (0x4ff000000000));
+        *index = filter_ranges;
         break;
     default:
         break;
     }
-    return FALSE;
+    NormalizeRanges(*index);
+    __sync_synchronize();
+    filter_index = index;
 }
 
-BOOL ExcludedAddressLive(ADDRINT ip)
+// Parses "begin-end[,begin-end...]" (hex) into ranges
+static bool ParseRanges(const char *s, rangevec_t &ranges)
 {
-// Always test for (logfilterlive) before calling this function!
-
-//    cerr << hex << ip << "<>" << filter_live_start << dec << endl;
-    if (ip == filter_live_start) {
-        filter_live_i++;
-        if ((filter_live_n == 0) || (filter_live_i == filter_live_n)) filter_live_reached=true;
-//        cerr << "BEGIN " << filter_live_i << " @" << hex << filter_live_start << dec << " -> " << filter_live_reached << endl;
-    }
-    if (ip == filter_live_stop) {
-        filter_live_reached=false;
-//        cerr << "END   " << filter_live_i << " @" << hex << filter_live_stop << dec << " -> " << filter_live_reached << endl;
+    char *endptr;
+    for (;;)
+    {
+        AddrRange r;
+        r.begin = strtoull(s, &endptr, 16);
+        if (endptr == s || endptr[0] != '-')
+            return false;
+        s = endptr + 1;
+        r.end = strtoull(s, &endptr, 16);
+        if (endptr == s || r.end <= r.begin)
+            return false;
+        ranges.push_back(r);
+        if (endptr[0] == '\0')
+            return true;
+        if (endptr[0] != ',')
+            return false;
+        s = endptr + 1;
     }
-    return !filter_live_reached;
+}
+
+// Does [addr, addr+size) touch one of the ranges
+static BOOL OverlapsRanges(const rangevec_t &ranges, ADDRINT addr, INT32 size)
+{
+    ADDRINT last = size > 0 ? addr + size - 1 : addr;
+    rangevec_t::const_iterator it = std::upper_bound(ranges.begin(), ranges.end(), last, RangeBeginLess());
+    if (it == ranges.begin())
+        return FALSE;
+    --it;
+    return addr <= it->end;
+}
+
+// If routine of the memory callbacks when -M is set. It only checks the
+// hull of the ranges, without branches or calls so PIN can inline it, the
+// Then routine (RecordMem) checks the ranges themselves.
+static ADDRINT MemFilterHull(ADDRINT addr, UINT32 size)
+{
+    return (addr <= mem_filter_hi) & (addr + size > mem_filter_lo);
+}
+
+#if defined(TARGET_IA32E)
+#define STACK_REDZONE 128
+#else
+#define STACK_REDZONE 0
+#endif
+
+// If routine of the memory callbacks when -S is set: the access is below
+// the stack pointer and its red zone, or above the top of the stack
+static ADDRINT NotStack(ADDRINT addr, UINT32 size, ADDRINT sp, ADDRINT top)
+{
+    return (addr + size <= sp - STACK_REDZONE) | (addr > top);
+}
+
+// Both -M and -S, written out so it stays inlinable
+static ADDRINT MemFilterHullNotStack(ADDRINT addr, UINT32 size, ADDRINT sp, ADDRINT top)
+{
+    return (addr <= mem_filter_hi) & (addr + size > mem_filter_lo) &
+           ((addr + size <= sp - STACK_REDZONE) | (addr > top));
 }
 
 /* ===================================================================== */
-/* Helper Functions for Instruction_cb                                   */
+/* Heap block filter                                                     */
 /* ===================================================================== */
 
-VOID printInst(ADDRINT ip, string *disass, INT32 size)
+// -A: the live heap blocks selected by size and/or call site (the return
+// address of the call to the allocator), start -> end
+bool alloc_filter=false;
+rangevec_t alloc_sizes;     // inclusive
+std::vector<ADDRINT> alloc_sites;
+typedef std::map<ADDRINT, ADDRINT> allocmap_t;
+allocmap_t allocs;
+PIN_RWMUTEX alloc_mutex;
+
+// Number of selected blocks touching each page, hashed. It never misses a
+// page of a block, so the inlined If routine only lets through the accesses
+// to pages holding one, RecordMem then checks the blocks themselves.
+#define ALLOC_PAGES 65536
+#define ALLOC_PAGE(a) (((a) >> 12) & (ALLOC_PAGES - 1))
+UINT32 alloc_pages[ALLOC_PAGES];
+
+// If routine of the memory callbacks when -A is set
+static ADDRINT AllocPages(ADDRINT addr, UINT32 size)
 {
-    if(fileExists()) return;
-    UINT8 v[32];
-    // test on logfilterlive here to avoid calls when not using live filtering
-    if (logfilterlive && ExcludedAddressLive(ip))
-        return;
-    if ((size_t)size > sizeof(v))
-    {
-        cerr << "[!] Instruction size > 32 at " << dec << bigcounter << hex << (void *)ip << " " << *disass << endl;
-        return;
-    }
-    // Custom filter
-    
-    PIN_GetLock(&lock, ip);
-    if (InfoType >= I) bigcounter++;
-    InfoType=I;
-    PIN_SafeCopy(v, (void *)ip, size);
-    switch (LogType) {
-        case HUMAN:
-            TraceFile << "[I]" << setw(10) << dec << bigcounter << hex << setw(16) << (void *)ip << "    " << setw(40) << left << *disass << right;
-            TraceFile << setfill('0');
-            for (INT32 i = 0; i < size; i++)
-            {
-                TraceFile << " " << setfill('0') << setw(2) << static_cast<UINT32>(v[i]);
-            }
-            TraceFile << setfill(' ');
-            TraceFile << endl;
-            break;
-        case SQLITE:
-            sqlite3_reset(ins_insert);
-            sqlite3_bind_int64(ins_insert, 1, bbl_id);
-            value.str("");
-            value.clear();
-            value << hex << "0x" << setfill('0') << setw(16) << ip;
-            strvalue = value.str();
-            sqlite3_bind_text(ins_insert, 2, strvalue.c_str(), -1, SQLITE_TRANSIENT);
-            sqlite3_bind_text(ins_insert, 3, (*disass).c_str(), -1, SQLITE_TRANSIENT);
-            value.str("");
-            value.clear();
-            value << setfill('0') << hex;
-            for (INT32 i = 0; i < size; i++)
-            {
-                value << setw(2) << static_cast<UINT32>(v[i]);
-            }
-            strvalue = value.str();
-            sqlite3_bind_text(ins_insert, 4, strvalue.c_str(), -1, SQLITE_TRANSIENT);
-            if(sqlite3_step(ins_insert) != SQLITE_DONE)
-                printf("INS error: %s\n", sqlite3_errmsg(db));
-            ins_id = sqlite3_last_insert_rowid(db);
-            break;
-    }
-// To get context, see https://software.intel.com/sites/landingpage/pintool/docs/49306/Pin/html/group__CONTEXT__API.html
-    PIN_ReleaseLock(&lock);
+    return alloc_pages[ALLOC_PAGE(addr)] | alloc_pages[ALLOC_PAGE(addr + size - 1)];
 }
 
-static VOID RecordMemHuman(ADDRINT ip, CHAR r, ADDRINT addr, UINT8* memdump, INT32 size, BOOL isPrefetch)
+static BOOL InAllocation(ADDRINT addr, INT32 size)
 {
-    if(fileExists()) return;
-    // TODO filter address here 
-
-    TraceFile << "[" << r << "]" << setw(10) << dec << bigcounter << hex << setw(16) << (void *) ip << "                                                   "
-              << " " << setw(18) << (void *) addr << " size="
-              << dec << setw(2) << size << " value="
-              << hex << setw(18-2*size);
-    if (!isPrefetch)
-    {
-        switch(size)
-        {
-        case 0:
-            TraceFile << setw(1);
-            break;
+    ADDRINT last = size > 0 ? addr + size - 1 : addr;
+    PIN_RWMutexReadLock(&alloc_mutex);
+    allocmap_t::const_iterator it = allocs.upper_bound(last);
+    BOOL in = it != allocs.begin() && addr < (--it)->second;
+    PIN_RWMutexUnlock(&alloc_mutex);
+    return in;
+}
 
-        case 1:
-            TraceFile << "0x" << setfill('0') << setw(2);
-            TraceFile << static_cast<UINT32>(*memdump);
-            TraceFile << setfill(' ');
-            break;
+// Then routine side of the -M and -A filters
+static BOOL MemSelected(ADDRINT addr, INT32 size)
+{
+    if (!mem_ranges.empty() && !OverlapsRanges(mem_ranges, addr, size))
+        return FALSE;
+    return !alloc_filter || InAllocation(addr, size);
+}
 
-        case 2:
-            TraceFile << "0x" << setfill('0') << setw(4);
-            TraceFile << *(UINT16*)memdump;
-            break;
+static VOID CountAllocPages(ADDRINT start, ADDRINT end, INT32 delta)
+{
+    UINT32 n = 0;
+    for (ADDRINT p = start >> 12; p <= (end - 1) >> 12 && n < ALLOC_PAGES; p++, n++)
+        alloc_pages[p & (ALLOC_PAGES - 1)] += delta;
+}
 
-        case 4:
-            TraceFile << "0x" << setfill('0') << setw(8);
-            TraceFile << *(UINT32*)memdump;
-            break;
+static bool SelectAlloc(ADDRINT site, size_t size)
+{
+    if (size == 0)
+        return false;
+    bool size_ok = alloc_sizes.empty();
+    for (rangevec_t::const_iterator it = alloc_sizes.begin(); it != alloc_sizes.end(); ++it)
+        if (it->begin <= size && size <= it->end)
+            size_ok = true;
+    if (!size_ok)
+        return false;
+    return alloc_sites.empty() ||
+           std::find(alloc_sites.begin(), alloc_sites.end(), site) != alloc_sites.end();
+}
 
-        case 8:
-            TraceFile << "0x" << setfill('0') << setw(16);
-            TraceFile << *(UINT64*)memdump;
-            break;
+static VOID TrackAlloc(ADDRINT start, size_t size)
+{
+    if (start == 0 || size == 0)
+        return;
+    PIN_RWMutexWriteLock(&alloc_mutex);
+    if (allocs.insert(std::make_pair(start, start + size)).second)
+        CountAllocPages(start, start + size, 1);
+    PIN_RWMutexUnlock(&alloc_mutex);
+}
 
-        default:
-            for (INT32 i = 0; i < size; i++)
-            {
-                TraceFile << " " << setfill('0') << setw(2) << static_cast<UINT32>(memdump[i]);
-            }
-            break;
-        }
+// Returns the size of the block if it was selected, 0 otherwise
+static size_t UntrackAlloc(ADDRINT start)
+{
+    size_t size = 0;
+    PIN_RWMutexWriteLock(&alloc_mutex);
+    allocmap_t::iterator it = allocs.find(start);
+    if (it != allocs.end())
+    {
+        size = it->second - it->first;
+        CountAllocPages(it->first, it->second, -1);
+        allocs.erase(it);
     }
-    TraceFile << setfill(' ') << endl;
+    PIN_RWMutexUnlock(&alloc_mutex);
+    return size;
 }
 
-static VOID RecordMemSqlite(ADDRINT ip, CHAR r, ADDRINT addr, UINT8* memdump, INT32 size, BOOL isPrefetch)
+// "32,16-64,@0x400abc": sizes or size ranges, and call sites
+static bool ParseAllocFilter(const char *s)
 {
-    // Insert read or write
-    if(fileExists()) return;
-    sqlite3_reset(mem_insert);
-    sqlite3_bind_int64(mem_insert, 1, r == 'R' ? (ins_id+1) : ins_id );
-    value.str("");
-    value.clear();
-    value << hex << "0x" << setfill('0') << setw(16) << ip;
-    strvalue = value.str();
-    sqlite3_bind_text(mem_insert, 2, strvalue.c_str(), -1, SQLITE_TRANSIENT);
-    char mode[2] = {0,0};
-    mode[0]=r;
-    sqlite3_bind_text(mem_insert, 3, mode, -1, SQLITE_TRANSIENT);
-    value.str("");
-    value.clear();
-    value << hex << "0x" << setfill('0') << setw(16) << addr;
-    strvalue = value.str();
-    sqlite3_bind_text(mem_insert, 4, strvalue.c_str(), -1, SQLITE_TRANSIENT);
-    value.str("");
-    value.clear();
-    value << hex << "0x" << setfill('0') << setw(16) << addr;
-    strvalue = value.str();
-    sqlite3_bind_text(mem_insert, 5, strvalue.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_int(mem_insert, 6, size);
-    if (!isPrefetch)
-    {
-        value.str("");
-        value.clear();
-        value << hex << setfill('0');
-        for (INT32 i = 0; i < size; i++)
+    char *endptr;
+    for (;;)
+    {
+        if (s[0] == '@')
         {
-            value << setw(2) << static_cast<UINT32>(memdump[i]);
+            ADDRINT site = strtoull(s + 1, &endptr, 16);
+            if (endptr == s + 1)
+                return false;
+            alloc_sites.push_back(site);
         }
-        strvalue = value.str();
-        sqlite3_bind_text(mem_insert, 7, strvalue.c_str(), -1, SQLITE_TRANSIENT);
-        value.str("");
-        value.clear();
-        value << hex  << "0x" << setfill('0');
-        switch(size)
+        else
         {
-        case 0:
-            break;
-        case 1:
-            value << setw(2) << static_cast<UINT32>(*memdump);
-            break;
-        case 2:
-            value << setw(4) << *(UINT16*)memdump;
-            break;
-        case 4:
-            value << setw(8) << *(UINT32*)memdump;
-            break;
-        case 8:
-            value << setw(16) << *(UINT64*)memdump;
-            break;
-        default:
-            break;
+            AddrRange r;
+            r.begin = strtoull(s, &endptr, 0);
+            if (endptr == s)
+                return false;
+            r.end = r.begin;
+            if (endptr[0] == '-')
+            {
+                s = endptr + 1;
+                r.end = strtoull(s, &endptr, 0);
+                if (endptr == s || r.end < r.begin)
+                    return false;
+            }
+            alloc_sizes.push_back(r);
         }
-        strvalue = value.str();
-        sqlite3_bind_text(mem_insert, 8, strvalue.c_str(), -1, SQLITE_TRANSIENT);
-        if(sqlite3_step(mem_insert) != SQLITE_DONE)
-            printf("MEM error: %s\n", sqlite3_errmsg(db));
+        if (endptr[0] == '\0')
+            return true;
+        if (endptr[0] != ',')
+            return false;
+        s = endptr + 1;
     }
 }
 
-static VOID RecordMem(ADDRINT ip, CHAR r, ADDRINT addr, INT32 size, BOOL isPrefetch)
+/* ===================================================================== */
+/* Symbol tables                                                         */
+/* ===================================================================== */
+
+// The routines of each image, sorted, are read once in ImageLoad_cb so the
+// call routines don't need RTN_FindNameByAddress (and PIN's client lock).
+// Images are found through symbol_index, rebuilt under the lock and
+// swapped in like filter_index. Tables of unloaded images are kept, a
+// lookup may still be using them and the sqlite writer their names.
+struct Symbol
 {
-    UINT8 memdump[256];
-   // addr =  0x50000000 - addr;
+    ADDRINT begin;
+    ADDRINT end;    // inclusive
+    string name;
+};
 
-    if(fileExists()) return;
-    // test on logfilterlive here to avoid calls when not using live filtering
-    if (logfilterlive && ExcludedAddressLive(ip))
-        return;
-    PIN_GetLock(&lock, ip);
-    if ((size_t)size > sizeof(memdump))
-    {
-        cerr << "[!] Memory size > " << sizeof(memdump) << " at " << dec << bigcounter << hex << (void *)ip << " " << (void *)addr << endl;
-        PIN_ReleaseLock(&lock);
-        return;
-    }
-    PIN_SafeCopy(memdump, (void *)addr, size);
-    switch (r) {
-        case 'R':
-            if (InfoType >= R) bigcounter++;
-            InfoType=R;
-            break;
-        case 'W':
-            if (InfoType >= W) bigcounter++;
-            InfoType=W;
-            break;
-    }
-    switch (LogType) {
-        case HUMAN:
-            RecordMemHuman(ip, r, addr, memdump, size, isPrefetch);
-            break;
-        case SQLITE:
-            RecordMemSqlite(ip, r, addr, memdump, size, isPrefetch);
-            break;
-    }
-    PIN_ReleaseLock(&lock);
-}
+struct SymbolTable
+{
+    ADDRINT begin;
+    ADDRINT end;
+    std::vector<Symbol> symbols;
+};
 
-static ADDRINT WriteAddr;
-static INT32 WriteSize;
+typedef std::vector<const SymbolTable*> symindex_t;
 
-static VOID RecordWriteAddrSize(ADDRINT addr, INT32 size)
-{
-    WriteAddr = addr;
-    WriteSize = size;
-}
+std::vector<const SymbolTable*> symbol_tables;  // loaded images, under the lock
+const symindex_t * volatile symbol_index = new symindex_t();
+static const string no_symbol;
 
+struct SymbolBeginLess
+{
+    bool operator()(ADDRINT a, const Symbol &s) const { return a < s.begin; }
+    bool operator()(const Symbol &a, const Symbol &b) const { return a.begin < b.begin; }
+    bool operator()(ADDRINT a, const SymbolTable *t) const { return a < t->begin; }
+    bool operator()(const SymbolTable *a, const SymbolTable *b) const { return a->begin < b->begin; }
+};
 
-static VOID RecordMemWrite(ADDRINT ip)
+// Call with the lock held
+static VOID RebuildSymbolIndex()
 {
-    RecordMem(ip, 'W', WriteAddr, WriteSize, false);
+    symindex_t *index = new symindex_t(symbol_tables);
+    std::sort(index->begin(), index->end(), SymbolBeginLess());
+    __sync_synchronize();
+    symbol_index = index;
 }
 
-/* ================================================================================= */
-/* This is called for each instruction                                               */
-/* ================================================================================= */
-VOID Instruction_cb(INS ins, VOID *v)
+// Call with the lock held
+static VOID AddSymbolTable(IMG img)
 {
-    if(fileExists()) return;
-    ADDRINT ceip = INS_Address(ins);
-    if(ExcludedAddress(ceip))
-        return;
-
-    if (KnobLogMem.Value()) {
-
-        if (INS_IsMemoryRead(ins))
+    SymbolTable *table = new SymbolTable;
+    table->begin = IMG_LowAddress(img);
+    table->end = IMG_HighAddress(img);
+    for (SEC sec = IMG_SecHead(img); SEC_Valid(sec); sec = SEC_Next(sec))
+    {
+        for (RTN rtn = SEC_RtnHead(sec); RTN_Valid(rtn); rtn = RTN_Next(rtn))
         {
-            INS_InsertPredicatedCall(
-                ins, IPOINT_BEFORE, (AFUNPTR)RecordMem,
-                IARG_INST_PTR,
-                IARG_UINT32, 'R',
-                IARG_MEMORYREAD_EA,
-                IARG_MEMORYREAD_SIZE,
-                IARG_BOOL, INS_IsPrefetch(ins),
-                IARG_END);
+            Symbol sym;
+            sym.begin = RTN_Address(rtn);
+            sym.end = sym.begin + (RTN_Size(rtn) ? RTN_Size(rtn) - 1 : 0);
+            sym.name = RTN_Name(rtn);
+            table->symbols.push_back(sym);
+            table->begin = std::min(table->begin, sym.begin);
+            table->end = std::max(table->end, sym.end);
         }
+    }
+    std::sort(table->symbols.begin(), table->symbols.end(), SymbolBeginLess());
+    symbol_tables.push_back(table);
+    RebuildSymbolIndex();
+}
 
-        if (INS_HasMemoryRead2(ins))
+// Call with the lock held
+static VOID RemoveSymbolTable(IMG img)
+{
+    for (std::vector<const SymbolTable*>::iterator it = symbol_tables.begin(); it != symbol_tables.end(); ++it)
+    {
+        if ((*it)->begin <= IMG_LowAddress(img) && IMG_LowAddress(img) <= (*it)->end)
         {
-            INS_InsertPredicatedCall(
-                ins, IPOINT_BEFORE, (AFUNPTR)RecordMem,
-                IARG_INST_PTR,
-                IARG_UINT32, 'R',
-                IARG_MEMORYREAD2_EA,
-                IARG_MEMORYREAD_SIZE,
-                IARG_BOOL, INS_IsPrefetch(ins),
-                IARG_END);
+            symbol_tables.erase(it);
+            RebuildSymbolIndex();
+            return;
         }
+    }
+}
+
+// Name of the routine containing addr, "" if none, like RTN_FindNameByAddress
+static const string& SymbolName(ADDRINT addr)
+{
+    const symindex_t *index = symbol_index;
+    symindex_t::const_iterator t = std::upper_bound(index->begin(), index->end(), addr, SymbolBeginLess());
+    if (t == index->begin())
+        return no_symbol;
+    --t;
+    if (addr > (*t)->end)
+        return no_symbol;
+    const std::vector<Symbol> &symbols = (*t)->symbols;
+    std::vector<Symbol>::const_iterator s = std::upper_bound(symbols.begin(), symbols.end(), addr, SymbolBeginLess());
+    if (s == symbols.begin())
+        return no_symbol;
+    --s;
+    return addr <= s->end ? s->name : no_symbol;
+}
+
+/* ===================================================================== */
+/* Helper Functions                                                      */
+/* ===================================================================== */
+
+BOOL ExcludedAddress(ADDRINT ip)
+{
+    const rangevec_t *ranges = filter_index;
+    switch (logfilter)
+    {
+    case 1:
+        if (! main_reached)
+        {
+	        // Filter loader before main
+	        if ((ip < main_begin) || (ip > main_end))
+	            return TRUE;
+            else
+                main_reached=true;
+		}
+        if ((ip >= main_begin) && (ip <= main_end))
+            return FALSE;
+        /* Is the EIP value within the range of any excluded module? */
+        return InRanges(ranges, ip);
+    case 2:
+    case 3:
+        return !InRanges(ranges, ip);
+    case 4: // Wasm
+        return (ip > (0x4ff000000000));
+        break;
+    default:
+        break;
+    }
+    return FALSE;
+}
+
+/* ===================================================================== */
+/* Live filter (-F start:stop, -n)                                       */
+/* ===================================================================== */
+
+// Traces are instrumented in two versions: VERSION_OFF, outside of the
+// window, only carries the markers of the start and stop instructions,
+// VERSION_ON is fully instrumented. The window state of each thread lives
+// in a tool register, and a marker asks for a version switch on the
+// instruction itself by returning LIVE_ENTER or LIVE_LEAVE. The
+// instruction then starts a trace of the other version, where its marker
+// just acknowledges the switch.
+#define VERSION_OFF 0
+#define VERSION_ON 1
+
+enum LiveState { LIVE_OFF, LIVE_ON, LIVE_ENTER, LIVE_LEAVE };
+
+REG live_reg;
+
+ADDRINT LiveFilterMarker(ADDRINT ip, ADDRINT state)
+{
+    if (state == LIVE_ENTER)
+        return LIVE_ON;
+    if (state == LIVE_LEAVE)
+        return LIVE_OFF;
+    bool live = (state == LIVE_ON);
+//    cerr << hex << ip << "<>" << filter_live_start << dec << endl;
+    if (ip == filter_live_start) {
+        INT32 i = __sync_add_and_fetch(&filter_live_i, 1);
+        if ((filter_live_n == 0) || (i == filter_live_n)) live=true;
+//        cerr << "BEGIN " << i << " @" << hex << filter_live_start << dec << " -> " << live << endl;
+    }
+    if (ip == filter_live_stop) {
+        // The -n occurrence was the last one worth tracing
+        if (live && filter_live_n != 0 && filter_live_i >= filter_live_n)
+            EndTracing();
+        live=false;
+//        cerr << "END   " << filter_live_i << " @" << hex << filter_live_stop << dec << " -> " << live << endl;
+    }
+    if (live == (state == LIVE_ON))
+        return state;
+    return live ? LIVE_ENTER : LIVE_LEAVE;
+}
+
+static VOID InstrumentLiveFilter(INS ins, ADDRINT version)
+{
+    INS_InsertCall(
+        ins, IPOINT_BEFORE, (AFUNPTR)LiveFilterMarker,
+        IARG_CALL_ORDER, CALL_ORDER_FIRST,
+        IARG_INST_PTR,
+        IARG_REG_VALUE, live_reg,
+        IARG_RETURN_REGS, live_reg,
+        IARG_END);
+    if (version == VERSION_ON)
+        INS_InsertVersionCase(ins, live_reg, LIVE_LEAVE, VERSION_OFF, IARG_END);
+    else
+        INS_InsertVersionCase(ins, live_reg, LIVE_ENTER, VERSION_ON, IARG_END);
+}
+
+/* ===================================================================== */
+/* Per-thread output                                                     */
+/* ===================================================================== */
+
+static inline ThreadLog* GetThreadLog(THREADID tid)
+{
+    return static_cast<ThreadLog*>(PIN_GetThreadData(tls_key, tid));
+}
+
+// Starts a new step of the global order unless the event belongs to the
+// current step of this thread (e.g. the memory accesses of an instruction)
+static inline VOID NextStep(ThreadLog *tl, InfoTypeType type)
+{
+    if (tl->InfoType >= type)
+        tl->counter = __sync_add_and_fetch(&bigcounter, 1);
+    tl->InfoType = type;
+}
+
+/* ===================================================================== */
+/* Flight recorder (-t ring)                                             */
+/* ===================================================================== */
+
+// Ring mode logs binary records but keeps them in memory: the chunks the
+// threads hand over replace the oldest ones of a ring of ring_chunks, the
+// messages every decoder needs (infos and libs) go to RingHeader. Only a
+// trigger writes them out (DumpRing): -e, a fatal signal or SIGUSR2. The
+// events of other threads not handed over yet are not part of a dump.
+bool ring_mode=false;
+std::ostringstream RingHeader;
+std::vector<std::string> ring;      // under the lock
+size_t ring_chunks=1;
+size_t ring_next=0;                 // oldest chunk once the ring is full
+UINT32 ring_dumps=0;
+
+// Call with the lock held
+static VOID RingStore(const char *data, size_t size)
+{
+    if (ring.size() < ring_chunks)
+    {
+        ring.push_back(std::string(data, size));
+        return;
+    }
+    ring[ring_next].assign(data, size);
+    ring_next = (ring_next + 1) % ring_chunks;
+}
+
+// Where the messages written once at the start go
+static std::ostream& HeaderStream()
+{
+    return ring_mode ? static_cast<std::ostream&>(RingHeader) : static_cast<std::ostream&>(TraceFile);
+}
+
+// Appends the pending output of a thread to the trace file as one chunk.
+// Chunks are tagged with the thread and a per-thread sequence number
+// (binary messages carry their own thread and exec ids).
+static VOID FlushThreadLog(ThreadLog *tl)
+{
+    if (tl->buf.size() == 0)
+        return;
+    PIN_GetLock(&lock, tl->tid + 1);
+    if (ring_mode)
+        RingStore(tl->buf.begin(), tl->buf.size());
+    else
+    {
+        if (LogType != BINARY)
+            TraceFile << "# Thread 0x" << hex << tl->uid << " chunk " << dec << tl->chunk << "\n";
+        TraceFile.write(tl->buf.begin(), tl->buf.size());
+    }
+    PIN_ReleaseLock(&lock);
+    tl->chunk++;
+    tl->buf.reset();
+}
+
+static inline VOID CheckThreadLog(ThreadLog *tl)
+{
+    if (tl->buf.size() >= THREAD_BUFFER_SIZE)
+        FlushThreadLog(tl);
+}
+
+/* ===================================================================== */
+/* Text formatter for the frequent human records                         */
+/* ===================================================================== */
+
+// Writes the same bytes as the equivalent iostream expressions (setw,
+// setfill, hex, (void *) pointers), without going through the stream.
+static char hex_lut[512];
+
+static VOID InitHexLut()
+{
+    const char *digits = "0123456789abcdef";
+    for (int i = 0; i < 256; i++)
+    {
+        hex_lut[2*i] = digits[i >> 4];
+        hex_lut[2*i+1] = digits[i & 15];
+    }
+}
+
+// Room for n bytes in the thread buffer
+static inline char* TextReserve(ThreadLog *tl, size_t n)
+{
+    if (tl->buf.avail() < n)
+        FlushThreadLog(tl);
+    return tl->buf.cur();
+}
+
+static inline char* PutStr(char *p, const char *s, size_t n)
+{
+    memcpy(p, s, n);
+    return p + n;
+}
+
+// n chars right-aligned in a field of width w, as with setw(w)
+static inline char* PutField(char *p, const char *s, INT32 n, INT32 w)
+{
+    for (; w > n; w--)
+        *p++ = ' ';
+    return PutStr(p, s, n);
+}
+
+// Digits of v written backwards before end, returns their number
+static inline INT32 FmtDec(char *end, UINT64 v)
+{
+    char *p = end;
+    do {
+        *--p = '0' + (v % 10);
+        v /= 10;
+    } while (v);
+    return end - p;
+}
+
+static inline INT32 FmtHex(char *end, UINT64 v)
+{
+    char *p = end;
+    for (; v >= 0x100; v >>= 8)
+    {
+        p -= 2;
+        memcpy(p, hex_lut + 2 * (v & 0xff), 2);
+    }
+    if (v >= 0x10)
+    {
+        p -= 2;
+        memcpy(p, hex_lut + 2 * v, 2);
+    }
+    else
+        *--p = hex_lut[2 * v + 1];
+    return end - p;
+}
+
+// dec << setw(w) << v
+static inline char* PutDec(char *p, UINT64 v, INT32 w = 0)
+{
+    char tmp[24];
+    INT32 n = FmtDec(tmp + sizeof(tmp), v);
+    return PutField(p, tmp + sizeof(tmp) - n, n, w);
+}
+
+// hex << v
+static inline char* PutHex(char *p, UINT64 v)
+{
+    char tmp[24];
+    INT32 n = FmtHex(tmp + sizeof(tmp), v);
+    return PutStr(p, tmp + sizeof(tmp) - n, n);
+}
+
+// hex << setfill('0') << setw(2 * bytes) << v, for v < 2^(8 * bytes)
+static inline char* PutHexBytes(char *p, UINT64 v, INT32 bytes)
+{
+    for (INT32 i = bytes - 1; i >= 0; i--)
+        p = PutStr(p, hex_lut + 2 * ((v >> (8 * i)) & 0xff), 2);
+    return p;
+}
+
+// setw(w) << (void *) v
+static inline char* PutPtr(char *p, UINT64 v, INT32 w)
+{
+    char tmp[24];
+    INT32 n = FmtHex(tmp + sizeof(tmp), v);
+    // like printf's %#x, no prefix for a null pointer
+    if (v != 0)
+    {
+        n += 2;
+        memcpy(tmp + sizeof(tmp) - n, "0x", 2);
+    }
+    return PutField(p, tmp + sizeof(tmp) - n, n, w);
+}
+
+/* ===================================================================== */
+/* Static instruction table                                              */
+/* ===================================================================== */
+
+// Instructions are interned by address and bytes: a code cache flush or a
+// new trace version reuses the record, self-modified code gets a new one.
+// Instrumentation callbacks are serialized by PIN, no lock is needed.
+typedef std::map<std::pair<ADDRINT, std::string>, StaticIns*> insmap_t;
+insmap_t static_ins;
+
+static StaticIns* InternIns(INS ins)
+{
+    UINT8 v[32];
+    ADDRINT ip = INS_Address(ins);
+    USIZE size = INS_Size(ins);
+    if (size > sizeof(v))
+    {
+        cerr << "[!] Instruction size > 32 at " << hex << (void *)ip << " " << INS_Disassemble(ins) << endl;
+        return NULL;
+    }
+    size = PIN_SafeCopy(v, (void *)ip, size);
+
+    StaticIns *&si = static_ins[std::make_pair(ip, std::string(reinterpret_cast<const char*>(v), size))];
+    if (si != NULL)
+        return si;
+    si = new StaticIns;
+    si->ip = ip;
+    si->size = size;
+    memcpy(si->bytes, v, size);
+    si->disass = INS_Disassemble(ins);
+    si->code_id = 0;
+
+    // "    " << setw(40) << left << disass, then the bytes
+    si->text = "    " + si->disass;
+    if (si->text.size() < 44)
+        si->text.append(44 - si->text.size(), ' ');
+    for (USIZE i = 0; i < size; i++)
+    {
+        si->text += ' ';
+        si->text.append(hex_lut + 2 * v[i], 2);
+    }
+    si->text += '\n';
+    return si;
+}
+
+/* ===================================================================== */
+/* TracerGrind binary trace protocol, see trace_protocol.h               */
+/* ===================================================================== */
+
+static inline VOID PutByte(std::ostream &os, UINT8 v)
+{
+    os.put(static_cast<char>(v));
+}
+
+static inline VOID PutU64(std::ostream &os, UINT64 v)
+{
+    os.write(reinterpret_cast<const char*>(&v), 8);
+}
+
+static VOID WriteInfoMsg(std::ostream &os, const char *key, const std::string &value)
+{
+    size_t keylen = strlen(key) + 1;
+    PutByte(os, MSG_INFO);
+    PutU64(os, 9 + keylen + value.size() + 1);
+    os.write(key, keylen);
+    os.write(value.c_str(), value.size() + 1);
+}
+
+static VOID WriteLibMsg(std::ostream &os, const std::string &name, ADDRINT base, ADDRINT end)
+{
+    PutByte(os, MSG_LIB);
+    PutU64(os, 25 + name.size() + 1);
+    PutU64(os, base);
+    PutU64(os, end);
+    os.write(name.c_str(), name.size() + 1);
+}
+
+static VOID WriteExecMsg(std::ostream &os, UINT64 exec_id, UINT64 thread_id, const ExecBlock *blk)
+{
+    PutByte(os, MSG_EXEC);
+    PutU64(os, 25 + blk->body.size());
+    PutU64(os, exec_id);
+    PutU64(os, thread_id);
+    os.write(blk->body.data(), blk->body.size());
+}
+
+static VOID WriteMemoryMsg(std::ostream &os, UINT64 exec_id, ADDRINT ip, UINT8 mode, ADDRINT addr, INT32 size, const UINT8 *data)
+{
+    PutByte(os, MSG_MEMORY);
+    PutU64(os, 42 + size);
+    PutU64(os, exec_id);
+    PutU64(os, ip);
+    PutByte(os, mode);
+    PutU64(os, addr);
+    PutU64(os, size);
+    os.write(reinterpret_cast<const char*>(data), size);
+}
+
+static VOID WriteThreadMsg(std::ostream &os, UINT64 exec_id, UINT64 thread_id, UINT8 type)
+{
+    PutByte(os, MSG_THREAD);
+    PutU64(os, 26);
+    PutU64(os, exec_id);
+    PutU64(os, thread_id);
+    PutByte(os, type);
+}
+
+// Memory messages of a block precede its MSG_EXEC, as in TracerGrind, so the
+// message of a block is only written once the next one starts. Chunks are
+// only handed over at that point, keeping each block with its memory events.
+static VOID FlushPendingExec(ThreadLog *tl)
+{
+    if (tl->pending == NULL)
+        return;
+    WriteExecMsg(tl->out, tl->exec_id, tl->uid, tl->pending);
+    tl->pending = NULL;
+    CheckThreadLog(tl);
+}
+
+// Blocks are interned by their serialized body, so re-instrumenting the
+// same code (code cache flush, trace versions) reuses the same ExecBlock
+std::map<std::string, ExecBlock*> exec_blocks;
+
+// Writes the ring, with the latest events of the calling thread, to the
+// trace file, or to <trace file>.<n> for the next dumps
+static VOID DumpRing()
+{
+    if (! ring_mode)
+        return;
+    THREADID tid = PIN_ThreadId();
+    ThreadLog *tl = (tid == INVALID_THREADID) ? NULL : GetThreadLog(tid);
+    if (tl != NULL)
+    {
+        FlushPendingExec(tl);
+        FlushThreadLog(tl);
+    }
+    PIN_GetLock(&lock, tl ? tl->tid + 1 : 0);
+    std::ostringstream name;
+    name << TraceName;
+    if (ring_dumps > 0)
+        name << "." << ring_dumps;
+    std::ofstream dump(name.str().c_str(), ios::out | ios::binary);
+    std::string header = RingHeader.str();
+    dump.write(header.data(), header.size());
+    for (size_t i = 0; i < ring.size(); i++)
+    {
+        const std::string &chunk = ring[(ring_next + i) % ring.size()];
+        dump.write(chunk.data(), chunk.size());
+    }
+    dump.close();
+    ring_dumps++;
+    PIN_ReleaseLock(&lock);
+    if (! KnobQuiet.Value())
+        cerr << "[*] Ring dumped to " << name.str() << endl;
+}
+
+// Fatal signals are ring triggers
+static VOID ContextChange_cb(THREADID tid, CONTEXT_CHANGE_REASON reason, const CONTEXT *from, CONTEXT *to, INT32 info, VOID *v)
+{
+    if (reason == CONTEXT_CHANGE_REASON_FATALSIGNAL)
+        DumpRing();
+}
+
+// SIGUSR2 asks for a dump, the program doesn't get it
+static BOOL RingSignal_cb(THREADID tid, INT32 sig, CONTEXT *ctxt, BOOL hasHandler, const EXCEPTION_INFO *pExceptInfo, VOID *v)
+{
+    DumpRing();
+    return FALSE;
+}
+
+static ExecBlock* InternExecBlock(BBL bbl)
+{
+    std::ostringstream body;
+    std::string code;
+    UINT8 v[32];
+    UINT64 number = BBL_NumIns(bbl);
+
+    PutU64(body, number);
+    PutU64(body, BBL_Size(bbl));
+    for (INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins = INS_Next(ins))
+        PutU64(body, INS_Address(ins));
+    for (INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins = INS_Next(ins))
+        PutByte(body, INS_Size(ins));
+    for (INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins = INS_Next(ins))
+    {
+        size_t size = PIN_SafeCopy(v, (void *)INS_Address(ins), INS_Size(ins) < sizeof(v) ? INS_Size(ins) : sizeof(v));
+        code.append(reinterpret_cast<const char*>(v), size);
+    }
+    body << code;
+
+    ExecBlock *&blk = exec_blocks[body.str()];
+    if (blk == NULL)
+    {
+        blk = new ExecBlock;
+        blk->addr = BBL_Address(bbl);
+        blk->body = body.str();
+    }
+    return blk;
+}
+
+/* ===================================================================== */
+/* Asynchronous SQLite writer                                            */
+/* ===================================================================== */
+
+// In sqlite mode the analysis routines only fill fixed-size records of a
+// bounded lock-free ring (Vyukov's MPMC queue, drained by a single consumer).
+// An internal PIN thread inserts them in batched transactions, so the traced
+// threads only wait on the database when the ring is full.
+#define SQL_RING_SIZE (1 << 16)     // records, must be a power of 2
+#define SQL_BATCH_SIZE 100000       // records per transaction
+#define SQL_INLINE_DATA 32          // larger data gets its own allocation
+
+enum SqlRecordType { SQL_BBL, SQL_INS, SQL_MEM, SQL_CALL, SQL_RET, SQL_LIB, SQL_THREAD_START, SQL_THREAD_EXIT };
+
+struct SqlRecord
+{
+    volatile UINT64 seq;
+    UINT8 type;
+    CHAR mode;
+    INT32 size;
+    PIN_THREAD_UID uid;
+    UINT64 addr;            // ip, bbl, memory or lib base, step counter for threads
+    UINT64 addr2;           // lib end
+    StaticIns *code;        // interned, code_id is set by the writer
+    string *name;           // lib name, freed by the writer
+    const string *sym;      // call target, owned by the symbol tables
+    UINT8 *ext;             // data above SQL_INLINE_DATA, freed by the writer
+    UINT8 data[SQL_INLINE_DATA];
+};
+
+// Last rows inserted for a thread, to link ins to bbl and mem to ins
+struct SqlThreadIds
+{
+    sqlite3_int64 bbl_id;
+    sqlite3_int64 ins_id;
+};
+
+SqlRecord *sql_ring;
+volatile UINT64 sql_enqueue_pos=0;
+UINT64 sql_dequeue_pos=0;
+UINT32 sql_batch=0;
+std::map<PIN_THREAD_UID, SqlThreadIds> sql_ids;
+PIN_LOCK sql_drain_lock;
+PIN_THREAD_UID sql_writer_uid;
+volatile bool sql_writer_stop=false;
+volatile bool sql_writer_exited=false;
+bool sql_forked=false;              // in a forked child: records are dropped
+
+static VOID SqlInitRing()
+{
+    sql_ring = new SqlRecord[SQL_RING_SIZE];
+    for (UINT64 i = 0; i < SQL_RING_SIZE; i++)
+        sql_ring[i].seq = i;
+    PIN_InitLock(&sql_drain_lock);
+}
+
+static VOID SqlWriteRecord(SqlRecord *rec)
+{
+    SqlThreadIds &ids = sql_ids[rec->uid];
+    const UINT8 *data = rec->ext ? rec->ext : rec->data;
+    switch (rec->type) {
+        case SQL_BBL:
+            sqlite3_reset(bbl_insert);
+            sqlite3_bind_int64(bbl_insert, 1, rec->addr);
+            sqlite3_bind_int(bbl_insert, 2, rec->size);
+            sqlite3_bind_int64(bbl_insert, 3, rec->uid);
+            if(sqlite3_step(bbl_insert) != SQLITE_DONE)
+                printf("BBL error: %s\n", sqlite3_errmsg(db));
+            ids.bbl_id = sqlite3_last_insert_rowid(db);
+            break;
+        case SQL_INS:
+            // First execution of this instruction: store its static part
+            if (rec->code->code_id == 0)
+            {
+                sqlite3_reset(code_insert);
+                sqlite3_bind_int64(code_insert, 1, rec->code->ip);
+                sqlite3_bind_text(code_insert, 2, rec->code->disass.c_str(), -1, SQLITE_STATIC);
+                sqlite3_bind_blob(code_insert, 3, rec->code->bytes, rec->code->size, SQLITE_STATIC);
+                if(sqlite3_step(code_insert) != SQLITE_DONE)
+                    printf("CODE error: %s\n", sqlite3_errmsg(db));
+                rec->code->code_id = sqlite3_last_insert_rowid(db);
+            }
+            sqlite3_reset(ins_insert);
+            sqlite3_bind_int64(ins_insert, 1, ids.bbl_id);
+            sqlite3_bind_int64(ins_insert, 2, rec->code->code_id);
+            if(sqlite3_step(ins_insert) != SQLITE_DONE)
+                printf("INS error: %s\n", sqlite3_errmsg(db));
+            ids.ins_id = sqlite3_last_insert_rowid(db);
+            break;
+        case SQL_MEM:
+            sqlite3_reset(mem_insert);
+            sqlite3_bind_int64(mem_insert, 1, rec->mode == 'R' ? (ids.ins_id+1) : ids.ins_id );
+            sqlite3_bind_text(mem_insert, 2, rec->mode == 'R' ? "R" : "W", -1, SQLITE_STATIC);
+            sqlite3_bind_int64(mem_insert, 3, rec->addr);
+            sqlite3_bind_int(mem_insert, 4, rec->size);
+            sqlite3_bind_blob(mem_insert, 5, data, rec->size, SQLITE_TRANSIENT);
+            if(sqlite3_step(mem_insert) != SQLITE_DONE)
+                printf("MEM error: %s\n", sqlite3_errmsg(db));
+            break;
+        // Like reads, calls and returns are logged before their instruction
+        case SQL_CALL:
+            sqlite3_reset(call_insert);
+            sqlite3_bind_int64(call_insert, 1, ids.ins_id+1);
+            sqlite3_bind_int64(call_insert, 2, rec->addr);
+            sqlite3_bind_text(call_insert, 3, rec->sym->c_str(), -1, SQLITE_STATIC);
+            if(sqlite3_step(call_insert) != SQLITE_DONE)
+                printf("CALL error: %s\n", sqlite3_errmsg(db));
+            break;
+        case SQL_RET:
+            sqlite3_reset(ret_insert);
+            sqlite3_bind_int64(ret_insert, 1, ids.ins_id+1);
+            sqlite3_bind_int64(ret_insert, 2, rec->addr);
+            if(sqlite3_step(ret_insert) != SQLITE_DONE)
+                printf("RET error: %s\n", sqlite3_errmsg(db));
+            break;
+        case SQL_LIB:
+            sqlite3_reset(lib_insert);
+            sqlite3_bind_text(lib_insert, 1, rec->name->c_str(), -1, SQLITE_TRANSIENT);
+            sqlite3_bind_int64(lib_insert, 2, rec->addr);
+            sqlite3_bind_int64(lib_insert, 3, rec->addr2);
+            if(sqlite3_step(lib_insert) != SQLITE_DONE)
+                printf("LIB error: %s\n", sqlite3_errmsg(db));
+            break;
+        case SQL_THREAD_START:
+            sqlite3_reset(thread_insert);
+            sqlite3_bind_int64(thread_insert, 1, rec->uid);
+            sqlite3_bind_int64(thread_insert, 2, rec->addr);
+            if(sqlite3_step(thread_insert) != SQLITE_DONE)
+                printf("THREAD error: %s\n", sqlite3_errmsg(db));
+            break;
+        case SQL_THREAD_EXIT:
+            sqlite3_reset(thread_update);
+            sqlite3_bind_int64(thread_update, 1, rec->addr);
+            sqlite3_bind_int64(thread_update, 2, rec->uid);
+            if(sqlite3_step(thread_update) != SQLITE_DONE)
+                printf("THREAD error: %s\n", sqlite3_errmsg(db));
+            sql_ids.erase(rec->uid);
+            break;
+    }
+    delete rec->name;
+    free(rec->ext);
+}
+
+// Inserts everything published so far, returns the number of records
+static UINT32 SqlDrain()
+{
+    UINT32 n = 0;
+    PIN_GetLock(&sql_drain_lock, 0);
+    for (;;)
+    {
+        SqlRecord *rec = &sql_ring[sql_dequeue_pos & (SQL_RING_SIZE - 1)];
+        if (rec->seq != sql_dequeue_pos + 1)
+            break;
+        __sync_synchronize();
+        if (sql_forked)
+        {
+            delete rec->name;
+            free(rec->ext);
+        }
+        else
+            SqlWriteRecord(rec);
+        __sync_synchronize();
+        rec->seq = sql_dequeue_pos + SQL_RING_SIZE;
+        sql_dequeue_pos++;
+        n++;
+        if (++sql_batch == SQL_BATCH_SIZE && !sql_forked)
+        {
+            sqlite3_exec(db, "COMMIT; BEGIN;", NULL, NULL, NULL);
+            sql_batch = 0;
+        }
+    }
+    PIN_ReleaseLock(&sql_drain_lock);
+    return n;
+}
+
+// Claims the next free record, waiting for the writer when the ring is full.
+// The record must then be handed over with SqlPublish.
+static SqlRecord* SqlReserve(UINT8 type, PIN_THREAD_UID uid, UINT64 *pos)
+{
+    UINT64 p = sql_enqueue_pos;
+    SqlRecord *rec;
+    for (;;)
+    {
+        rec = &sql_ring[p & (SQL_RING_SIZE - 1)];
+        INT64 dif = (INT64)(rec->seq - p);
+        if (dif == 0)
+        {
+            if (__sync_bool_compare_and_swap(&sql_enqueue_pos, p, p + 1))
+                break;
+        }
+        else if (dif < 0)
+        {
+            // Full. Once the writer is gone (process exiting), drain it ourselves
+            if (sql_writer_exited)
+                SqlDrain();
+            else
+                PIN_Yield();
+        }
+        p = sql_enqueue_pos;
+    }
+    rec->type = type;
+    rec->uid = uid;
+    rec->size = 0;
+    rec->code = NULL;
+    rec->name = NULL;
+    rec->sym = NULL;
+    rec->ext = NULL;
+    *pos = p;
+    return rec;
+}
+
+static inline VOID SqlPublish(SqlRecord *rec, UINT64 pos)
+{
+    __sync_synchronize();
+    rec->seq = pos + 1;
+}
+
+static VOID SqlSetData(SqlRecord *rec, const UINT8 *data, INT32 size)
+{
+    UINT8 *dst = rec->data;
+    if (size > SQL_INLINE_DATA)
+        dst = rec->ext = (UINT8 *)malloc(size);
+    memcpy(dst, data, size);
+    rec->size = size;
+}
+
+static VOID SqlWriterThread(VOID *arg)
+{
+    while (!sql_writer_stop && !PIN_IsProcessExiting())
+    {
+        if (SqlDrain() == 0)
+            PIN_Sleep(1);
+    }
+    SqlDrain();
+    sql_writer_exited = true;
+}
+
+// The remaining records are inserted by Fini
+static VOID SqlStopWriter()
+{
+    if (sql_forked)
+        return;
+    sql_writer_stop = true;
+    PIN_WaitForThreadTermination(sql_writer_uid, PIN_INFINITE_TIMEOUT, NULL);
+    sql_writer_exited = true;
+}
+
+// The database connection can't be shared with a forked child and the child
+// has no writer thread: it keeps tracing into the ring but its records are
+// dropped, starting with the ones it inherited, by the threads filling it
+static VOID SqlForkChild()
+{
+    for (UINT64 i = 0; i < SQL_RING_SIZE; i++)
+    {
+        SqlRecord *rec = &sql_ring[i];
+        // Published and not inserted yet
+        if (((rec->seq - i) & (SQL_RING_SIZE - 1)) == 1)
+        {
+            delete rec->name;
+            free(rec->ext);
+        }
+        rec->seq = i;
+    }
+    sql_enqueue_pos = 0;
+    sql_dequeue_pos = 0;
+    sql_forked = true;
+    sql_writer_exited = true;
+    PIN_InitLock(&sql_drain_lock);
+}
+
+/* ===================================================================== */
+/* Helper Functions for Instruction_cb                                   */
+/* ===================================================================== */
+
+// The analysis routines are templates on the log type (and on whatever
+// else the instrumentation knows), see SelectAnalysisFuns: the switches
+// below are resolved at compile time.
+template<LogTypeType L>
+static VOID printInst(THREADID tid, StaticIns *si)
+{
+    ThreadLog *tl = GetThreadLog(tid);
+    // Custom filter
+    
+    NextStep(tl, I);
+    switch (L) {
+        case HUMAN:
+        {
+            char *p = TextReserve(tl, 64 + si->text.size());
+            p = PutStr(p, "[I]", 3);
+            p = PutDec(p, tl->counter, 10);
+            p = PutPtr(p, si->ip, 16);
+            p = PutStr(p, si->text.data(), si->text.size());
+            tl->buf.commit(p);
+            CheckThreadLog(tl);
+            break;
+        }
+        case SQLITE:
+        {
+            UINT64 pos;
+            SqlRecord *rec = SqlReserve(SQL_INS, tl->uid, &pos);
+            rec->code = si;
+            SqlPublish(rec, pos);
+            break;
+        }
+        case BINARY:
+            break;
+    }
+// To get context, see https://software.intel.com/sites/landingpage/pintool/docs/49306/Pin/html/group__CONTEXT__API.html
+}
+
+template<CHAR Mode, bool Prefetch>
+static VOID RecordMemHuman(ThreadLog *tl, ADDRINT ip, ADDRINT addr, UINT8* memdump, INT32 size)
+{
+    char *p = TextReserve(tl, 128 + 3 * size);
+    *p++ = '[';
+    *p++ = Mode;
+    *p++ = ']';
+    p = PutDec(p, tl->counter, 10);
+    p = PutPtr(p, ip, 16);
+    p = PutStr(p, "                                                    ", 52);
+    p = PutPtr(p, addr, 18);
+    p = PutStr(p, " size=", 6);
+    p = PutDec(p, size, 2);
+    p = PutStr(p, " value=", 7);
+    if (!Prefetch)
+    {
+        // Pending setw(18-2*size), taken by the first string of the value
+        INT32 w = 18 - 2 * size;
+        switch(size)
+        {
+        case 0:
+            break;
+
+        case 1:
+            p = PutField(p, "0x", 2, w);
+            p = PutHexBytes(p, *memdump, 1);
+            break;
+
+        case 2:
+            p = PutField(p, "0x", 2, w);
+            p = PutHexBytes(p, *(UINT16*)memdump, 2);
+            break;
+
+        case 4:
+            p = PutField(p, "0x", 2, w);
+            p = PutHexBytes(p, *(UINT32*)memdump, 4);
+            break;
+
+        case 8:
+            p = PutField(p, "0x", 2, w);
+            p = PutHexBytes(p, *(UINT64*)memdump, 8);
+            break;
+
+        default:
+            for (INT32 i = 0; i < size; i++)
+            {
+                p = (i == 0) ? PutField(p, " ", 1, w) : PutStr(p, " ", 1);
+                p = PutStr(p, hex_lut + 2 * memdump[i], 2);
+            }
+            break;
+        }
+    }
+    *p++ = '\n';
+    tl->buf.commit(p);
+    CheckThreadLog(tl);
+}
+
+template<CHAR Mode>
+static VOID RecordMemSqlite(ThreadLog *tl, ADDRINT addr, UINT8* memdump, INT32 size)
+{
+    // Insert read or write
+    UINT64 pos;
+    SqlRecord *rec = SqlReserve(SQL_MEM, tl->uid, &pos);
+    rec->mode = Mode;
+    rec->addr = addr;
+    SqlSetData(rec, memdump, size);
+    SqlPublish(rec, pos);
+}
+
+// Mode is 'R' or 'W', Filtered is set with -M or -A
+template<LogTypeType L, CHAR Mode, bool Prefetch, bool Filtered>
+static VOID RecordMem(THREADID tid, ADDRINT ip, ADDRINT addr, INT32 size)
+{
+    UINT8 memdump[256];
+   // addr =  0x50000000 - addr;
+    if (Filtered && ! MemSelected(addr, size))
+        return;
+    ThreadLog *tl = GetThreadLog(tid);
+    if ((size_t)size > sizeof(memdump))
+    {
+        cerr << "[!] Memory size > " << sizeof(memdump) << " at " << dec << tl->counter << hex << (void *)ip << " " << (void *)addr << endl;
+        return;
+    }
+    NextStep(tl, Mode == 'R' ? R : W);
+    // The value of a prefetch is never logged
+    if (!Prefetch)
+        PIN_SafeCopy(memdump, (void *)addr, size);
+    switch (L) {
+        case HUMAN:
+            RecordMemHuman<Mode, Prefetch>(tl, ip, addr, memdump, size);
+            break;
+        case SQLITE:
+            if (!Prefetch)
+                RecordMemSqlite<Mode>(tl, addr, memdump, size);
+            break;
+        case BINARY:
+            WriteMemoryMsg(tl->out, tl->pending ? tl->exec_id : tl->counter, ip,
+                           Mode == 'R' ? MODE_READ : MODE_WRITE, addr, Prefetch ? 0 : size, memdump);
+            if (tl->pending == NULL)
+                CheckThreadLog(tl);
+            break;
+    }
+}
+
+static VOID RecordWriteAddrSize(THREADID tid, ADDRINT addr, INT32 size)
+{
+    ThreadLog *tl = GetThreadLog(tid);
+    tl->WriteAddr = addr;
+    tl->WriteSize = size;
+}
+
+
+// Nothing to do when RecordWriteAddrSize didn't run (predicate or -M)
+template<LogTypeType L, bool Filtered>
+static VOID RecordMemWrite(THREADID tid, ADDRINT ip)
+{
+    ThreadLog *tl = GetThreadLog(tid);
+    if (tl->WriteSize == 0)
+        return;
+    RecordMem<L, 'W', false, Filtered>(tid, ip, tl->WriteAddr, tl->WriteSize);
+    tl->WriteSize = 0;
+}
+
+// Inserts the inlined If routine of the -M, -S and -A filters, if any.
+// Returns whether the memory callback has to be inserted as its Then routine.
+static bool InsertMemFilter(INS ins, IARG_TYPE ea, IARG_TYPE size)
+{
+    // heap blocks are never on the stack, and -M is checked by RecordMem
+    if (alloc_filter)
+        INS_InsertIfPredicatedCall(
+            ins, IPOINT_BEFORE, (AFUNPTR)AllocPages,
+            ea,
+            size,
+            IARG_END);
+    else if (filter_stack && !mem_ranges.empty())
+        INS_InsertIfPredicatedCall(
+            ins, IPOINT_BEFORE, (AFUNPTR)MemFilterHullNotStack,
+            ea,
+            size,
+            IARG_REG_VALUE, REG_STACK_PTR,
+            IARG_REG_VALUE, stack_top_reg,
+            IARG_END);
+    else if (filter_stack)
+        INS_InsertIfPredicatedCall(
+            ins, IPOINT_BEFORE, (AFUNPTR)NotStack,
+            ea,
+            size,
+            IARG_REG_VALUE, REG_STACK_PTR,
+            IARG_REG_VALUE, stack_top_reg,
+            IARG_END);
+    else if (!mem_ranges.empty())
+        INS_InsertIfPredicatedCall(
+            ins, IPOINT_BEFORE, (AFUNPTR)MemFilterHull,
+            ea,
+            size,
+            IARG_END);
+    else
+        return false;
+    return true;
+}
+
+// With -M or -S the read is only recorded (copied, formatted, written) when
+// the inlined filter lets it through
+static VOID InsertMemRead(INS ins, IARG_TYPE ea)
+{
+    AFUNPTR fun = INS_IsPrefetch(ins) ? afun.prefetch : afun.read;
+    if (!InsertMemFilter(ins, ea, IARG_MEMORYREAD_SIZE))
+    {
+        INS_InsertPredicatedCall(
+            ins, IPOINT_BEFORE, fun,
+            IARG_THREAD_ID,
+            IARG_INST_PTR,
+            ea,
+            IARG_MEMORYREAD_SIZE,
+            IARG_END);
+        return;
+    }
+    INS_InsertThenPredicatedCall(
+        ins, IPOINT_BEFORE, fun,
+        IARG_THREAD_ID,
+        IARG_INST_PTR,
+        ea,
+        IARG_MEMORYREAD_SIZE,
+        IARG_END);
+}
+
+/* ================================================================================= */
+/* This is called for each instruction of a trace, see Trace_cb                      */
+/* ================================================================================= */
+static VOID InstrumentIns(INS ins, ADDRINT version, bool capped)
+{
+    ADDRINT ceip = INS_Address(ins);
+    if(ExcludedAddress(ceip))
+        return;
+
+    if (logfilterlive && (ceip == filter_live_start || ceip == filter_live_stop))
+        InstrumentLiveFilter(ins, version);
+    if (logfilterlive && version != VERSION_ON)
+        return;
+    if (coverage || capped)
+        return;
+
+    if (KnobLogMem.Value()) {
+
+        // with -S, accesses through the stack pointer are dropped here, the
+        // other ones (frame pointer, pointers to locals) by the If routine
+        bool skip_read = filter_stack && INS_IsStackRead(ins) && !INS_HasMemoryRead2(ins);
+        bool skip_write = filter_stack && INS_IsStackWrite(ins);
+
+        if (INS_IsMemoryRead(ins) && !skip_read)
+            InsertMemRead(ins, IARG_MEMORYREAD_EA);
+
+        if (INS_HasMemoryRead2(ins))
+            InsertMemRead(ins, IARG_MEMORYREAD2_EA);
 
         // instruments stores using a predicated call, i.e.
         // the call happens iff the store will be actually executed
-        if (INS_IsMemoryWrite(ins))
+        if (INS_IsMemoryWrite(ins) && !skip_write)
         {
-            INS_InsertPredicatedCall(
-                ins, IPOINT_BEFORE, (AFUNPTR)RecordWriteAddrSize,
-                IARG_MEMORYWRITE_EA,
-                IARG_MEMORYWRITE_SIZE,
-                IARG_END);
+            if (!InsertMemFilter(ins, IARG_MEMORYWRITE_EA, IARG_MEMORYWRITE_SIZE))
+            {
+                INS_InsertPredicatedCall(
+                    ins, IPOINT_BEFORE, (AFUNPTR)RecordWriteAddrSize,
+                    IARG_THREAD_ID,
+                    IARG_MEMORYWRITE_EA,
+                    IARG_MEMORYWRITE_SIZE,
+                    IARG_END);
+            }
+            else
+            {
+                INS_InsertThenPredicatedCall(
+                    ins, IPOINT_BEFORE, (AFUNPTR)RecordWriteAddrSize,
+                    IARG_THREAD_ID,
+                    IARG_MEMORYWRITE_EA,
+                    IARG_MEMORYWRITE_SIZE,
+                    IARG_END);
+            }
 
             if (INS_HasFallThrough(ins))
             {
                 INS_InsertCall(
-                    ins, IPOINT_AFTER, (AFUNPTR)RecordMemWrite,
+                    ins, IPOINT_AFTER, afun.write,
+                    IARG_THREAD_ID,
                     IARG_INST_PTR,
                     IARG_END);
             }
             if (INS_IsControlFlow(ins))
             {
                 INS_InsertCall(
-                    ins, IPOINT_TAKEN_BRANCH, (AFUNPTR)RecordMemWrite,
+                    ins, IPOINT_TAKEN_BRANCH, afun.write,
+                    IARG_THREAD_ID,
                     IARG_INST_PTR,
                     IARG_END);
             }
 
         }
     }
-    if (KnobLogIns.Value()) {
-        string* disass = new string(INS_Disassemble(ins));
+    // In binary mode instructions are logged with their block, see LogExecBlock
+    if (KnobLogIns.Value() && LogType != BINARY) {
+        StaticIns *si = InternIns(ins);
+        if (si == NULL)
+            return;
         INS_InsertCall(
-            ins, IPOINT_BEFORE, (AFUNPTR)printInst,
-            IARG_INST_PTR,
-            IARG_PTR, disass,
-            IARG_UINT32, INS_Size(ins),
+            ins, IPOINT_BEFORE, afun.ins,
+            IARG_THREAD_ID,
+            IARG_PTR, si,
             IARG_END);
     }
 }
 
 
+/* ===================================================================== */
+/* Allocator replacement (-A)                                            */
+/* ===================================================================== */
+
+// The allocators still run under PIN through PIN_CallApplicationFunction.
+// The blocks they allocate for themselves (e.g. calloc calling malloc) are
+// not seen a second time.
+static bool EnterAlloc(ThreadLog *tl)
+{
+    if (tl == NULL)
+        return false;
+    bool nested = tl->in_alloc;
+    tl->in_alloc = true;
+    return nested;
+}
+
+static VOID LeaveAlloc(ThreadLog *tl, bool nested)
+{
+    if (tl != NULL)
+        tl->in_alloc = nested;
+}
+
+static VOID *Malloc_rep(const CONTEXT *ctxt, THREADID tid, AFUNPTR orig, size_t size, ADDRINT site)
+{
+    VOID *p;
+    ThreadLog *tl = GetThreadLog(tid);
+    bool nested = EnterAlloc(tl);
+    PIN_CallApplicationFunction(ctxt, tid, CALLINGSTD_DEFAULT, orig, NULL,
+                                PIN_PARG(void *), &p,
+                                PIN_PARG(size_t), size,
+                                PIN_PARG_END());
+    LeaveAlloc(tl, nested);
+    if (!nested && SelectAlloc(site, size))
+        TrackAlloc((ADDRINT)p, size);
+    return p;
+}
+
+static VOID *Calloc_rep(const CONTEXT *ctxt, THREADID tid, AFUNPTR orig, size_t nmemb, size_t size, ADDRINT site)
+{
+    VOID *p;
+    ThreadLog *tl = GetThreadLog(tid);
+    bool nested = EnterAlloc(tl);
+    PIN_CallApplicationFunction(ctxt, tid, CALLINGSTD_DEFAULT, orig, NULL,
+                                PIN_PARG(void *), &p,
+                                PIN_PARG(size_t), nmemb,
+                                PIN_PARG(size_t), size,
+                                PIN_PARG_END());
+    LeaveAlloc(tl, nested);
+    // p is NULL on overflow
+    if (!nested && SelectAlloc(site, nmemb * size))
+        TrackAlloc((ADDRINT)p, nmemb * size);
+    return p;
+}
+
+// A selected block stays selected when it moves
+static VOID *Realloc_rep(const CONTEXT *ctxt, THREADID tid, AFUNPTR orig, VOID *ptr, size_t size, ADDRINT site)
+{
+    VOID *p;
+    ThreadLog *tl = GetThreadLog(tid);
+    bool nested = EnterAlloc(tl);
+    size_t old = nested ? 0 : UntrackAlloc((ADDRINT)ptr);
+    PIN_CallApplicationFunction(ctxt, tid, CALLINGSTD_DEFAULT, orig, NULL,
+                                PIN_PARG(void *), &p,
+                                PIN_PARG(void *), ptr,
+                                PIN_PARG(size_t), size,
+                                PIN_PARG_END());
+    LeaveAlloc(tl, nested);
+    if (nested)
+        return p;
+    if (p != NULL && (old != 0 || SelectAlloc(site, size)))
+        TrackAlloc((ADDRINT)p, size);
+    else if (p == NULL && size != 0)
+        TrackAlloc((ADDRINT)ptr, old);  // failed, ptr is untouched
+    return p;
+}
+
+static VOID Free_rep(const CONTEXT *ctxt, THREADID tid, AFUNPTR orig, VOID *ptr)
+{
+    ThreadLog *tl = GetThreadLog(tid);
+    bool nested = EnterAlloc(tl);
+    if (!nested)
+        UntrackAlloc((ADDRINT)ptr);
+    PIN_CallApplicationFunction(ctxt, tid, CALLINGSTD_DEFAULT, orig, NULL,
+                                PIN_PARG(void),
+                                PIN_PARG(void *), ptr,
+                                PIN_PARG_END());
+    LeaveAlloc(tl, nested);
+}
+
+static VOID ReplaceAllocators(IMG img)
+{
+    RTN rtn = RTN_FindByName(img, "malloc");
+    if (RTN_Valid(rtn))
+    {
+        PROTO proto = PROTO_Allocate(PIN_PARG(void *), CALLINGSTD_DEFAULT, "malloc",
+                                     PIN_PARG(size_t), PIN_PARG_END());
+        RTN_ReplaceSignature(rtn, AFUNPTR(Malloc_rep),
+                             IARG_PROTOTYPE, proto,
+                             IARG_CONST_CONTEXT,
+                             IARG_THREAD_ID,
+                             IARG_ORIG_FUNCPTR,
+                             IARG_FUNCARG_ENTRYPOINT_VALUE, 0,
+                             IARG_RETURN_IP,
+                             IARG_END);
+        PROTO_Free(proto);
+    }
+    rtn = RTN_FindByName(img, "calloc");
+    if (RTN_Valid(rtn))
+    {
+        PROTO proto = PROTO_Allocate(PIN_PARG(void *), CALLINGSTD_DEFAULT, "calloc",
+                                     PIN_PARG(size_t), PIN_PARG(size_t), PIN_PARG_END());
+        RTN_ReplaceSignature(rtn, AFUNPTR(Calloc_rep),
+                             IARG_PROTOTYPE, proto,
+                             IARG_CONST_CONTEXT,
+                             IARG_THREAD_ID,
+                             IARG_ORIG_FUNCPTR,
+                             IARG_FUNCARG_ENTRYPOINT_VALUE, 0,
+                             IARG_FUNCARG_ENTRYPOINT_VALUE, 1,
+                             IARG_RETURN_IP,
+                             IARG_END);
+        PROTO_Free(proto);
+    }
+    rtn = RTN_FindByName(img, "realloc");
+    if (RTN_Valid(rtn))
+    {
+        PROTO proto = PROTO_Allocate(PIN_PARG(void *), CALLINGSTD_DEFAULT, "realloc",
+                                     PIN_PARG(void *), PIN_PARG(size_t), PIN_PARG_END());
+        RTN_ReplaceSignature(rtn, AFUNPTR(Realloc_rep),
+                             IARG_PROTOTYPE, proto,
+                             IARG_CONST_CONTEXT,
+                             IARG_THREAD_ID,
+                             IARG_ORIG_FUNCPTR,
+                             IARG_FUNCARG_ENTRYPOINT_VALUE, 0,
+                             IARG_FUNCARG_ENTRYPOINT_VALUE, 1,
+                             IARG_RETURN_IP,
+                             IARG_END);
+        PROTO_Free(proto);
+    }
+    rtn = RTN_FindByName(img, "free");
+    if (RTN_Valid(rtn))
+    {
+        PROTO proto = PROTO_Allocate(PIN_PARG(void), CALLINGSTD_DEFAULT, "free",
+                                     PIN_PARG(void *), PIN_PARG_END());
+        RTN_ReplaceSignature(rtn, AFUNPTR(Free_rep),
+                             IARG_PROTOTYPE, proto,
+                             IARG_CONST_CONTEXT,
+                             IARG_THREAD_ID,
+                             IARG_ORIG_FUNCPTR,
+                             IARG_FUNCARG_ENTRYPOINT_VALUE, 0,
+                             IARG_END);
+        PROTO_Free(proto);
+    }
+}
+
 /* ================================================================================= */
 /* This is called every time a MODULE (dll, etc.) is LOADED                          */
 /* ================================================================================= */
+// Images are recorded even while paused, the filters depend on them
 void ImageLoad_cb(IMG Img, void *v)
 {
-    if(fileExists()) return;
     std::string imageName = IMG_Name(Img);
     ADDRINT lowAddress = IMG_LowAddress(Img);
     ADDRINT highAddress = IMG_HighAddress(Img);
     bool filtered = false;
+    // Modules loaded at run time are logged in sequence with the events of
+    // the loading thread, the initial ones go straight to the trace file
+    THREADID tid = PIN_ThreadId();
+    ThreadLog *tl = (tid == INVALID_THREADID) ? NULL : GetThreadLog(tid);
+    // In ring mode they must survive the ring, they go to its header
+    std::ostream &log = (tl && !ring_mode) ? static_cast<std::ostream&>(tl->out) : HeaderStream();
+    if (alloc_filter)
+        ReplaceAllocators(Img);
     PIN_GetLock(&lock, 0);
+    AddSymbolTable(Img);
     if(IMG_IsMainExecutable(Img))
     {
         switch (LogType) {
             case HUMAN:
-                TraceFile << "[-] Analysing main image: " << imageName << endl;
-                TraceFile << "[-] Image base: 0x" << hex << lowAddress  << endl;
-                TraceFile << "[-] Image end:  0x" << hex << highAddress << endl;
+                log << "[-] Analysing main image: " << imageName << endl;
+                log << "[-] Image base: 0x" << hex << lowAddress  << endl;
+                log << "[-] Image end:  0x" << hex << highAddress << endl;
                 if (logfilter==2)
                 {
-                    TraceFile << "[!] Filter all addresses out of that range" << endl;
+                    log << "[!] Filter all addresses out of that range" << endl;
                 }
                 break;
             case SQLITE:
-                sqlite3_reset(lib_insert);
-                sqlite3_bind_text(lib_insert, 1, imageName.c_str(), -1, SQLITE_TRANSIENT);
-                value.str("");
-                value.clear();
-                value << hex << "0x" << setfill('0') << setw(16) << lowAddress;
-                strvalue = value.str();
-                sqlite3_bind_text(lib_insert, 2, strvalue.c_str(), -1, SQLITE_TRANSIENT);
-                value.str("");
-                value.clear();
-                value << hex << "0x" << setfill('0') << setw(16) << highAddress;
-                strvalue = value.str();
-                sqlite3_bind_text(lib_insert, 3, strvalue.c_str(), -1, SQLITE_TRANSIENT);
-                if(sqlite3_step(lib_insert) != SQLITE_DONE)
-                    printf("LIB error: %s\n", sqlite3_errmsg(db));
+            {
+                UINT64 pos;
+                SqlRecord *rec = SqlReserve(SQL_LIB, 0, &pos);
+                rec->name = new string(imageName);
+                rec->addr = lowAddress;
+                rec->addr2 = highAddress;
+                SqlPublish(rec, pos);
+                break;
+            }
+            case BINARY:
+                WriteLibMsg(log, imageName, lowAddress, highAddress);
                 break;
         }
         main_begin = lowAddress;
         main_end = highAddress;
+        RebuildFilterIndex();
     } else {
         if((logfilter == 1) &&
                 ((imageName.compare(0, 10, "C:\\WINDOWS") == 0) ||
@@ -632,128 +2111,621 @@ void ImageLoad_cb(IMG Img, void *v)
             mod_data[imageName].excluded = TRUE;
             mod_data[imageName].begin = lowAddress;
             mod_data[imageName].end = highAddress;
+            RebuildFilterIndex();
+        }
+        switch (LogType) {
+            case HUMAN:
+                log << "[-] Loaded module: " << imageName << endl;
+                if (filtered)
+                    log << "[!] Filtered " << imageName << endl;
+                log << "[-] Module base: 0x" << hex << lowAddress  << endl;
+                log << "[-] Module end:  0x" << hex << highAddress << endl;
+                break;
+            case SQLITE:
+            {
+                UINT64 pos;
+                SqlRecord *rec = SqlReserve(SQL_LIB, 0, &pos);
+                rec->name = new string(imageName);
+                rec->addr = lowAddress;
+                rec->addr2 = highAddress;
+                SqlPublish(rec, pos);
+                break;
+            }
+            case BINARY:
+                WriteLibMsg(log, imageName, lowAddress, highAddress);
+                break;
+        }
+    }
+    PIN_ReleaseLock(&lock);
+}
+
+// Unloaded modules leave the filter, their range may get reused
+void ImageUnload_cb(IMG Img, void *v)
+{
+    PIN_GetLock(&lock, 0);
+    RemoveSymbolTable(Img);
+    modmap_t::iterator it = mod_data.find(IMG_Name(Img));
+    if (it != mod_data.end() && it->second.begin == IMG_LowAddress(Img))
+    {
+        mod_data.erase(it);
+        RebuildFilterIndex();
+    }
+    PIN_ReleaseLock(&lock);
+}
+
+/* ===================================================================== */
+/* Helper Functions for Trace_cb                                         */
+/* ===================================================================== */
+
+template<LogTypeType L>
+static VOID LogBasicBlock(THREADID tid, ADDRINT addr, UINT32 size)
+{
+    ThreadLog *tl = GetThreadLog(tid);
+    NextStep(tl, B);
+    tl->currentbbl=tl->counter;
+    switch (L) {
+        case HUMAN:
+        {
+            char *p = TextReserve(tl, 128);
+            p = PutStr(p, "[B]", 3);
+            p = PutDec(p, tl->counter, 10);
+            p = PutPtr(p, addr, 16);
+            p = PutStr(p, " loc_", 5);
+            p = PutHex(p, addr);
+            p = PutStr(p, ": // size=", 10);
+            p = PutDec(p, size);
+            p = PutStr(p, " thread=0x", 10);
+            p = PutHex(p, tl->uid);
+            *p++ = '\n';
+            tl->buf.commit(p);
+            CheckThreadLog(tl);
+            break;
+        }
+        case SQLITE:
+        {
+            UINT64 pos;
+            SqlRecord *rec = SqlReserve(SQL_BBL, tl->uid, &pos);
+            rec->addr = addr;
+            rec->size = size;
+            SqlPublish(rec, pos);
+            break;
+        }
+        case BINARY:
+            break;
+    }
+}
+
+void LogExecBlock(THREADID tid, const ExecBlock *blk)
+{
+    ThreadLog *tl = GetThreadLog(tid);
+    FlushPendingExec(tl);
+    NextStep(tl, B);
+    tl->currentbbl = tl->counter;
+    tl->exec_id = tl->counter;
+    tl->pending = blk;
+}
+
+// Args is set with -C, nameFunc is resolved at instrumentation time for direct calls
+template<LogTypeType L, bool Args>
+static VOID LogCallAndArgs(THREADID tid, ADDRINT ip, const string *nameFunc, ADDRINT arg0, ADDRINT arg1, ADDRINT arg2)
+{
+    ThreadLog *tl = GetThreadLog(tid);
+    NextStep(tl, C);
+    switch (L) {
+        case HUMAN:
+            tl->out << "[C]" << setw(10) << dec << tl->counter << hex << " Calling function 0x" << ip << "(" << *nameFunc << ")";
+            if (Args) {
+                tl->out << " with args: ("
+                          << (void *) arg0 << " (" << SymbolName(arg0) << " ), "
+                          << (void *) arg1 << " (" << SymbolName(arg1) << " ), "
+                          << (void *) arg2 << " (" << SymbolName(arg2) << " )";
+            }
+            tl->out << endl;
+            if (ExcludedAddress(ip))
+            {
+                tl->out << "[!] Function 0x" << ip << " is filtered, no tracing" << endl;
+            }
+            CheckThreadLog(tl);
+            break;
+        case SQLITE:
+        {
+            UINT64 pos;
+            SqlRecord *rec = SqlReserve(SQL_CALL, tl->uid, &pos);
+            rec->addr = ip;
+            rec->sym = nameFunc;
+            SqlPublish(rec, pos);
+            break;
+        }
+        case BINARY:
+            // The protocol has no call message
+            break;
+    }
+}
+
+template<LogTypeType L, bool Args>
+static VOID LogIndirectCallAndArgs(THREADID tid, ADDRINT target, BOOL taken, ADDRINT arg0, ADDRINT arg1, ADDRINT arg2)
+{
+    if (!taken)
+        return;
+    LogCallAndArgs<L, Args>(tid, target, &SymbolName(target), arg0, arg1, arg2);
+}
+
+/* ===================================================================== */
+/* Shadow call stack (-p)                                                */
+/* ===================================================================== */
+
+// Each thread keeps a stack of the calls it made and counts the executed
+// instructions per block. A ret pops the frame pushed by its call, found
+// by the stack pointer, so frames skipped by longjmp or exceptions are
+// popped by the next ret of an outer frame. Frames feed the per-thread
+// profile, merged into profile when the thread ends and written by Fini.
+// The inclusive count of a recursive function includes its nested calls.
+profile_t profile;  // under the lock
+
+static VOID ProfileCount(THREADID tid, UINT32 n)
+{
+    GetThreadLog(tid)->executed += n;
+}
+
+static VOID ShadowCall(THREADID tid, ADDRINT target, ADDRINT sp)
+{
+    ThreadLog *tl = GetThreadLog(tid);
+    Frame f;
+    f.func = target;
+    f.sp = sp - sizeof(ADDRINT);    // the return address gets pushed
+    f.entry = tl->executed;
+    f.children = 0;
+    tl->stack.push_back(f);
+}
+
+static VOID PopFrame(ThreadLog *tl)
+{
+    Frame f = tl->stack.back();
+    tl->stack.pop_back();
+    UINT64 inclusive = tl->executed - f.entry;
+    FuncStats &st = tl->profile[f.func];
+    st.calls++;
+    st.inclusive += inclusive;
+    st.exclusive += inclusive - f.children;
+    if (! tl->stack.empty())
+        tl->stack.back().children += inclusive;
+}
+
+// traced is false in filtered code: the stack is kept, nothing is logged
+template<LogTypeType L>
+static VOID ShadowReturn(THREADID tid, ADDRINT ip, ADDRINT sp, BOOL traced)
+{
+    ThreadLog *tl = GetThreadLog(tid);
+    // Frames deeper than this ret were left without returning
+    while (! tl->stack.empty() && tl->stack.back().sp < sp)
+        PopFrame(tl);
+    // Not a call we saw
+    if (tl->stack.empty() || tl->stack.back().sp != sp)
+        return;
+    ADDRINT func = tl->stack.back().func;
+    PopFrame(tl);
+    if (! traced)
+        return;
+    NextStep(tl, C);
+    switch (L) {
+        case HUMAN:
+            tl->out << "[X]" << setw(10) << dec << tl->counter << setw(16) << (void *) ip << " Returning from function 0x" << hex << func << "(" << SymbolName(func) << ")" << endl;
+            CheckThreadLog(tl);
+            break;
+        case SQLITE:
+        {
+            UINT64 pos;
+            SqlRecord *rec = SqlReserve(SQL_RET, tl->uid, &pos);
+            rec->addr = func;
+            SqlPublish(rec, pos);
+            break;
+        }
+        case BINARY:
+            break;
+    }
+}
+
+// Closes the frames left and hands the thread profile over
+static VOID MergeProfile(ThreadLog *tl)
+{
+    while (! tl->stack.empty())
+        PopFrame(tl);
+    PIN_GetLock(&lock, tl->tid + 1);
+    for (profile_t::iterator it = tl->profile.begin(); it != tl->profile.end(); ++it)
+    {
+        FuncStats &st = profile[it->first];
+        st.calls += it->second.calls;
+        st.inclusive += it->second.inclusive;
+        st.exclusive += it->second.exclusive;
+    }
+    PIN_ReleaseLock(&lock);
+    tl->profile.clear();
+}
+
+// Every block counts, even filtered ones, so the frames stay consistent
+static VOID InstrumentShadowStack(BBL bbl, bool traced)
+{
+    INS tail = BBL_InsTail(bbl);
+    INS_InsertCall(BBL_InsHead(bbl), IPOINT_BEFORE, (AFUNPTR)ProfileCount,
+        IARG_THREAD_ID,
+        IARG_UINT32, BBL_NumIns(bbl),
+        IARG_END);
+    if (INS_IsCall(tail))
+    {
+        INS_InsertPredicatedCall(tail, IPOINT_BEFORE, (AFUNPTR)ShadowCall,
+            IARG_THREAD_ID,
+            IARG_BRANCH_TARGET_ADDR,
+            IARG_REG_VALUE, REG_STACK_PTR,
+            IARG_END);
+    }
+    else if (INS_IsRet(tail))
+    {
+        INS_InsertPredicatedCall(tail, IPOINT_BEFORE, afun.ret,
+            IARG_THREAD_ID,
+            IARG_INST_PTR,
+            IARG_REG_VALUE, REG_STACK_PTR,
+            IARG_BOOL, traced,
+            IARG_END);
+    }
+}
+
+static bool FuncStatsMore(const std::pair<ADDRINT, FuncStats> &a, const std::pair<ADDRINT, FuncStats> &b)
+{
+    return a.second.exclusive > b.second.exclusive;
+}
+
+// Called by Fini once everything else is written, hottest functions first
+static VOID WriteProfile()
+{
+    std::vector<std::pair<ADDRINT, FuncStats> > funcs(profile.begin(), profile.end());
+    std::sort(funcs.begin(), funcs.end(), FuncStatsMore);
+    sqlite3_stmt *profile_insert = NULL;
+    if (LogType == SQLITE)
+        sqlite3_prepare_v2(db, "INSERT INTO profile (addr, name, calls, inclusive, exclusive) VALUES (?, ?, ?, ?, ?);", -1, &profile_insert, NULL);
+    for (size_t i = 0; i < funcs.size(); i++)
+    {
+        const FuncStats &st = funcs[i].second;
+        switch (LogType) {
+            case HUMAN:
+                TraceFile << "[P] Function 0x" << hex << funcs[i].first << "(" << SymbolName(funcs[i].first) << ")" << dec
+                          << " calls=" << st.calls << " inclusive=" << st.inclusive << " exclusive=" << st.exclusive << endl;
+                break;
+            case SQLITE:
+                sqlite3_reset(profile_insert);
+                sqlite3_bind_int64(profile_insert, 1, funcs[i].first);
+                sqlite3_bind_text(profile_insert, 2, SymbolName(funcs[i].first).c_str(), -1, SQLITE_STATIC);
+                sqlite3_bind_int64(profile_insert, 3, st.calls);
+                sqlite3_bind_int64(profile_insert, 4, st.inclusive);
+                sqlite3_bind_int64(profile_insert, 5, st.exclusive);
+                if(sqlite3_step(profile_insert) != SQLITE_DONE)
+                    printf("PROFILE error: %s\n", sqlite3_errmsg(db));
+                break;
+            case BINARY:
+                break;
         }
+    }
+    sqlite3_finalize(profile_insert);
+}
+
+/* ===================================================================== */
+/* Coverage (-v)                                                         */
+/* ===================================================================== */
+
+// Instead of being logged, blocks only increment their counter, with an
+// analysis routine simple enough for PIN to inline (no call, no lock).
+// Counters are interned by block like ExecBlocks. Concurrent executions
+// of a block may lose a few counts. Fini writes the table.
+struct BblCount
+{
+    ADDRINT addr;
+    UINT32 size;
+    UINT32 ins;
+    UINT64 count;
+};
+
+typedef std::map<std::pair<ADDRINT, UINT32>, BblCount*> bblcountmap_t;
+bblcountmap_t bbl_counts;
+
+static VOID PIN_FAST_ANALYSIS_CALL CountBbl(UINT64 *count)
+{
+    (*count)++;
+}
+
+static VOID InstrumentCoverage(BBL bbl)
+{
+    BblCount *&c = bbl_counts[std::make_pair(BBL_Address(bbl), (UINT32)BBL_Size(bbl))];
+    if (c == NULL)
+    {
+        c = new BblCount;
+        c->addr = BBL_Address(bbl);
+        c->size = BBL_Size(bbl);
+        c->ins = BBL_NumIns(bbl);
+        c->count = 0;
+    }
+    INS_InsertCall(BBL_InsHead(bbl), IPOINT_BEFORE, (AFUNPTR)CountBbl,
+        IARG_FAST_ANALYSIS_CALL,
+        IARG_PTR, &c->count,
+        IARG_END);
+}
+
+// Called by Fini, executed blocks by address
+static VOID WriteCoverage()
+{
+    sqlite3_stmt *coverage_insert = NULL;
+    if (LogType == SQLITE)
+        sqlite3_prepare_v2(db, "INSERT INTO coverage (addr, size, ins, count) VALUES (?, ?, ?, ?);", -1, &coverage_insert, NULL);
+    for (bblcountmap_t::const_iterator it = bbl_counts.begin(); it != bbl_counts.end(); ++it)
+    {
+        const BblCount *c = it->second;
+        if (c->count == 0)
+            continue;
         switch (LogType) {
             case HUMAN:
-                TraceFile << "[-] Loaded module: " << imageName << endl;
-                if (filtered)
-                    TraceFile << "[!] Filtered " << imageName << endl;
-                TraceFile << "[-] Module base: 0x" << hex << lowAddress  << endl;
-                TraceFile << "[-] Module end:  0x" << hex << highAddress << endl;
+                TraceFile << "[V] loc_" << hex << c->addr << dec << " size=" << c->size
+                          << " ins=" << c->ins << " count=" << c->count << endl;
                 break;
             case SQLITE:
-                sqlite3_reset(lib_insert);
-                sqlite3_bind_text(lib_insert, 1, imageName.c_str(), -1, SQLITE_TRANSIENT);
-                value.str("");
-                value.clear();
-                value << hex << "0x" << setfill('0') << setw(16) << lowAddress;
-                strvalue = value.str();
-                sqlite3_bind_text(lib_insert, 2, strvalue.c_str(), -1, SQLITE_TRANSIENT);
-                value.str("");
-                value.clear();
-                value << hex << "0x" << setfill('0') << setw(16) << highAddress;
-                strvalue = value.str();
-                sqlite3_bind_text(lib_insert, 3, strvalue.c_str(), -1, SQLITE_TRANSIENT);
-                if(sqlite3_step(lib_insert) != SQLITE_DONE)
-                    printf("LIB error: %s\n", sqlite3_errmsg(db));
+                sqlite3_reset(coverage_insert);
+                sqlite3_bind_int64(coverage_insert, 1, c->addr);
+                sqlite3_bind_int(coverage_insert, 2, c->size);
+                sqlite3_bind_int(coverage_insert, 3, c->ins);
+                sqlite3_bind_int64(coverage_insert, 4, c->count);
+                if(sqlite3_step(coverage_insert) != SQLITE_DONE)
+                    printf("COVERAGE error: %s\n", sqlite3_errmsg(db));
+                break;
+            case BINARY:
                 break;
         }
     }
-    PIN_ReleaseLock(&lock);
+    sqlite3_finalize(coverage_insert);
 }
 
 /* ===================================================================== */
-/* Helper Functions for Trace_cb                                         */
+/* Block budget (-k, -K)                                                 */
 /* ===================================================================== */
 
-void LogBasicBlock(ADDRINT addr, UINT32 size)
+// Each block is logged for its first -k executions, then its code is
+// regenerated with nothing but an inlined counter. With -K the counter
+// brings the logged version back for one execution every -K. Counters are
+// kept by block address across regenerations, like the capped state.
+struct BudgetBlock
 {
-    if(fileExists()) return;
-    PIN_GetLock(&lock, addr);
-    if (InfoType >= B) bigcounter++;
-    InfoType=B;
-    currentbbl=bigcounter;
-    switch (LogType) {
-        case HUMAN:
-            TraceFile << "[B]" << setw(10) << dec << bigcounter << hex << setw(16) << (void *) addr << " loc_" << hex << addr << ":";
-            TraceFile << " // size=" << dec << size;
-            TraceFile << " thread=" << "0x" << hex << PIN_ThreadUid() << endl;
-            break;
-        case SQLITE:
-            sqlite3_reset(bbl_insert);
-            value.str("");
-            value.clear();
-            value << "0x" << hex << setfill('0') << setw(16) << addr;
-            strvalue = value.str();
-            sqlite3_bind_text(bbl_insert, 1, strvalue.c_str(), -1, SQLITE_TRANSIENT);
-            value.str("");
-            value.clear();
-            value << hex << "0x" << setfill('0') << setw(16) << addr + size - 1;
-            strvalue = value.str();
-            sqlite3_bind_text(bbl_insert, 2, strvalue.c_str(), -1, SQLITE_TRANSIENT);
-            sqlite3_bind_int(bbl_insert, 3, size);
-            sqlite3_bind_int64(bbl_insert, 4, PIN_ThreadUid());
-            if(sqlite3_step(bbl_insert) != SQLITE_DONE)
-                printf("BBL error: %s\n", sqlite3_errmsg(db));
-            bbl_id = sqlite3_last_insert_rowid(db);
-            break;
-    }
-    PIN_ReleaseLock(&lock);
+    UINT64 count;
+    volatile UINT32 capped;
+};
+
+UINT64 budget=0;
+UINT64 budget_every=0;
+std::map<ADDRINT, BudgetBlock*> budget_blocks;
+
+static ADDRINT PIN_FAST_ANALYSIS_CALL BudgetSpent(UINT64 *count)
+{
+    return ++*count >= budget;
+}
+
+static ADDRINT PIN_FAST_ANALYSIS_CALL BudgetSample(UINT64 *count)
+{
+    return (++*count - budget) % budget_every == 0;
+}
+
+// The current execution of the block is not affected, the next ones run
+// the regenerated code. Until then the old code keeps asking for the same
+// switch: only the first call, in any thread, does it.
+static VOID SetCapped(BudgetBlock *b, ADDRINT addr, UINT32 size, UINT32 capped)
+{
+    if (!__sync_bool_compare_and_swap(&b->capped, !capped, capped))
+        return;
+    PIN_LockClient();
+    PIN_RemoveInstrumentationInRange(addr, addr + size - 1);
+    PIN_UnlockClient();
+}
+
+static VOID CapBlock(BudgetBlock *b, ADDRINT addr, UINT32 size)
+{
+    SetCapped(b, addr, size, 1);
 }
 
-void LogCallAndArgs(ADDRINT ip, ADDRINT arg0, ADDRINT arg1, ADDRINT arg2)
+static VOID UncapBlock(BudgetBlock *b, ADDRINT addr, UINT32 size)
 {
-    if(fileExists()) return;
-    string nameFunc = "";
-    string nameArg0 = "";
-    string nameArg1 = "";
-    string nameArg2 = "";
+    SetCapped(b, addr, size, 0);
+}
 
-    nameFunc = RTN_FindNameByAddress(ip);
-    if (KnobLogCallArgs.Value()) {
-        nameArg0 = RTN_FindNameByAddress(arg0);
-        nameArg1 = RTN_FindNameByAddress(arg1);
-        nameArg2 = RTN_FindNameByAddress(arg2);
+// Returns whether the block is capped, i.e. must not be logged
+static bool InstrumentBudget(BBL bbl)
+{
+    ADDRINT addr = BBL_Address(bbl);
+    BudgetBlock *&b = budget_blocks[addr];
+    if (b == NULL)
+    {
+        b = new BudgetBlock;
+        b->count = 0;
+        b->capped = 0;
     }
+    UINT64 *count = &b->count;
+    bool capped = b->capped != 0;
+    if (!capped)
+    {
+        BBL_InsertIfCall(bbl, IPOINT_BEFORE, (AFUNPTR)BudgetSpent,
+            IARG_FAST_ANALYSIS_CALL,
+            IARG_PTR, count,
+            IARG_END);
+        BBL_InsertThenCall(bbl, IPOINT_BEFORE, (AFUNPTR)CapBlock,
+            IARG_PTR, b,
+            IARG_ADDRINT, addr,
+            IARG_UINT32, BBL_Size(bbl),
+            IARG_END);
+    }
+    else if (budget_every != 0)
+    {
+        BBL_InsertIfCall(bbl, IPOINT_BEFORE, (AFUNPTR)BudgetSample,
+            IARG_FAST_ANALYSIS_CALL,
+            IARG_PTR, count,
+            IARG_END);
+        BBL_InsertThenCall(bbl, IPOINT_BEFORE, (AFUNPTR)UncapBlock,
+            IARG_PTR, b,
+            IARG_ADDRINT, addr,
+            IARG_UINT32, BBL_Size(bbl),
+            IARG_END);
+    }
+    else
+    {
+        BBL_InsertCall(bbl, IPOINT_BEFORE, (AFUNPTR)CountBbl,
+            IARG_FAST_ANALYSIS_CALL,
+            IARG_PTR, count,
+            IARG_END);
+    }
+    return capped;
+}
+
+/* ===================================================================== */
+/* Analysis routine selection                                            */
+/* ===================================================================== */
+
+// Instantiates the specializations and fills afun
+template<LogTypeType L, bool Filtered>
+static VOID SelectMemFuns()
+{
+    afun.read = AFUNPTR(RecordMem<L, 'R', false, Filtered>);
+    afun.prefetch = AFUNPTR(RecordMem<L, 'R', true, Filtered>);
+    afun.write = AFUNPTR(RecordMemWrite<L, Filtered>);
+}
+
+template<LogTypeType L, bool Args>
+static VOID SelectCallFuns()
+{
+    afun.call = AFUNPTR(LogCallAndArgs<L, Args>);
+    afun.indirect_call = AFUNPTR(LogIndirectCallAndArgs<L, Args>);
+}
+
+template<LogTypeType L>
+static VOID SelectFuns()
+{
+    afun.ins = AFUNPTR(printInst<L>);
+    afun.bbl = AFUNPTR(LogBasicBlock<L>);
+    afun.ret = AFUNPTR(ShadowReturn<L>);
+    if (KnobLogCallArgs.Value())
+        SelectCallFuns<L, true>();
+    else
+        SelectCallFuns<L, false>();
+    if (mem_ranges.empty() && !alloc_filter)
+        SelectMemFuns<L, false>();
+    else
+        SelectMemFuns<L, true>();
+}
 
-    PIN_GetLock(&lock, ip);
-    if (InfoType >= C) bigcounter++;
-    InfoType=C;
+// Call once LogType and -M are known
+static VOID SelectAnalysisFuns()
+{
     switch (LogType) {
         case HUMAN:
-            TraceFile << "[C]" << setw(10) << dec << bigcounter << hex << " Calling function 0x" << ip << "(" << nameFunc << ")";
-            if (KnobLogCallArgs.Value()) {
-                TraceFile << " with args: ("
-                          << (void *) arg0 << " (" << nameArg0 << " ), "
-                          << (void *) arg1 << " (" << nameArg1 << " ), "
-                          << (void *) arg2 << " (" << nameArg2 << " )";
-            }
-            TraceFile << endl;
-            if (ExcludedAddress(ip))
-            {
-                TraceFile << "[!] Function 0x" << ip << " is filtered, no tracing" << endl;
-            }
+            SelectFuns<HUMAN>();
             break;
         case SQLITE:
-            value.str("");
-            value.clear();
-            value << "0x" << hex << setfill('0') << setw(16) << ip;
-            strvalue = value.str();
-            sqlite3_bind_text(call_insert, 1, strvalue.c_str(), -1, SQLITE_TRANSIENT);
-            sqlite3_bind_text(call_insert, 2, nameFunc.c_str(), -1, SQLITE_TRANSIENT);
-            if(sqlite3_step(call_insert) != SQLITE_DONE)
-                printf("CALL error: %s\n", sqlite3_errmsg(db));
+            SelectFuns<SQLITE>();
+            break;
+        case BINARY:
+            SelectFuns<BINARY>();
             break;
     }
-    PIN_ReleaseLock(&lock);
 }
 
-void LogIndirectCallAndArgs(ADDRINT target, BOOL taken, ADDRINT arg0, ADDRINT arg1, ADDRINT arg2)
+// Block level events: calls at the tail, block at the head
+static VOID InstrumentBbl(TRACE trace, BBL bbl)
 {
-    if(fileExists()) return;
-    if (!taken)
+    if (coverage)
+    {
+        InstrumentCoverage(bbl);
         return;
-    LogCallAndArgs(target, arg0, arg1, arg2);
+    }
+    INS head = BBL_InsHead(bbl);
+    if((KnobLogCall.Value() || KnobLogCallArgs.Value()) && LogType != BINARY)
+    {
+        /* ===================================================================================== */
+        /* Code to instrument the events at the end of a BBL (execution transfer)                */
+        /* Checking for calls, etc.                                                              */
+        /* ===================================================================================== */
+        INS tail = BBL_InsTail(bbl);
+
+        if(INS_IsCall(tail))
+        {
+            if(INS_IsDirectControlFlow(tail))
+            {
+                const ADDRINT target = INS_DirectControlFlowTargetAddress(tail);
+
+                INS_InsertPredicatedCall(
+                    tail,
+                    IPOINT_BEFORE,
+                    afun.call,                          // Function to jump to
+                    IARG_THREAD_ID,
+                    IARG_ADDRINT,                       // "target"'s type
+                    target,                             // Who is called?
+                    IARG_PTR,                           // Its name
+                    &SymbolName(target),
+                    IARG_FUNCARG_ENTRYPOINT_VALUE,      // Arg_0 value
+                    0,
+                    IARG_FUNCARG_ENTRYPOINT_VALUE,      // Arg_1 value
+                    1,
+                    IARG_FUNCARG_ENTRYPOINT_VALUE,      // Arg_2 value
+                    2,
+                    IARG_END
+                );
+            }
+            else
+            {
+                INS_InsertCall(
+                    tail,
+                    IPOINT_BEFORE,
+                    afun.indirect_call,
+                    IARG_THREAD_ID,
+                    IARG_BRANCH_TARGET_ADDR,
+                    IARG_BRANCH_TAKEN,
+                    IARG_FUNCARG_ENTRYPOINT_VALUE,
+                    0,
+                    IARG_FUNCARG_ENTRYPOINT_VALUE,
+                    1,
+                    IARG_FUNCARG_ENTRYPOINT_VALUE,
+                    2,
+                    IARG_END
+                );
+            }
+        }
+        else
+        {
+            /* Other forms of execution transfer */
+            RTN rtn = TRACE_Rtn(trace);
+            // Trace jmp into DLLs (.idata section that is, imports)
+            if(RTN_Valid(rtn) && SEC_Name(RTN_Sec(rtn)) == ".idata")
+            {
+                INS_InsertCall(
+                    tail,
+                    IPOINT_BEFORE,
+                    afun.indirect_call,
+                    IARG_THREAD_ID,
+                    IARG_BRANCH_TARGET_ADDR,
+                    IARG_BRANCH_TAKEN,
+                    IARG_FUNCARG_ENTRYPOINT_VALUE,
+                    0,
+                    IARG_FUNCARG_ENTRYPOINT_VALUE,
+                    1,
+                    IARG_FUNCARG_ENTRYPOINT_VALUE,
+                    2,
+                    IARG_END
+                );
+            }
+        }
+    }
+    /* Instrument at basic block level? */
+    if(LogType == BINARY)
+    {
+        /* one MSG_EXEC per executed block, carrying its instructions */
+        if(KnobLogBB.Value() || KnobLogIns.Value())
+            INS_InsertCall(head, IPOINT_BEFORE, AFUNPTR(LogExecBlock), IARG_THREAD_ID, IARG_PTR, InternExecBlock(bbl), IARG_END);
+    }
+    else if(KnobLogBB.Value())
+    {
+        /* instrument BBL_InsHead to write "loc_XXXXX", like in IDA Pro */
+        INS_InsertCall(head, IPOINT_BEFORE, afun.bbl, IARG_THREAD_ID, IARG_ADDRINT, BBL_Address(bbl), IARG_UINT32, BBL_Size(bbl), IARG_END);
+    }
 }
 
 /* ================================================================================= */
@@ -762,92 +2734,55 @@ void LogIndirectCallAndArgs(ADDRINT target, BOOL taken, ADDRINT arg0, ADDRINT ar
 /* Pin guarantees that a trace is only entered at the top,                           */
 /* but it may contain multiple exits.                                                */
 /* ================================================================================= */
+// Fast-forward: nothing but the instruction counter, and the -F markers so
+// that their occurrences are counted and the window follows them
+static VOID InstrumentFastForward(TRACE trace)
+{
+    ADDRINT version = TRACE_Version(trace);
+    for(BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl))
+    {
+        if (logfilterlive)
+            for(INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins = INS_Next(ins))
+            {
+                ADDRINT ceip = INS_Address(ins);
+                if ((ceip == filter_live_start || ceip == filter_live_stop) && !ExcludedAddress(ceip))
+                    InstrumentLiveFilter(ins, version);
+            }
+        if(ExcludedAddress(BBL_Address(bbl)))
+            continue;
+        BBL_InsertIfCall(bbl, IPOINT_BEFORE, (AFUNPTR)FastForwardCount, IARG_UINT32, BBL_NumIns(bbl), IARG_END);
+        BBL_InsertThenCall(bbl, IPOINT_BEFORE, (AFUNPTR)FastForwardDone, IARG_END);
+    }
+}
+
 void Trace_cb(TRACE trace, void *v)
 {
-    if(fileExists()) return;
+    if(tracing_paused || tracing_over) return;
+    if(fast_forward)
+    {
+        InstrumentFastForward(trace);
+        return;
+    }
+    // Instructions are instrumented here rather than in an INS callback,
+    // which wouldn't know the version of the trace
+    ADDRINT version = TRACE_Version(trace);
+    bool bbl_level = !logfilterlive || version == VERSION_ON;
     /* Iterate through basic blocks */
     for(BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl))
     {
         INS head = BBL_InsHead(bbl);
         if(ExcludedAddress(INS_Address(head)))
-            return;
-        /* Instrument function calls? */
-        if(KnobLogCall.Value() || KnobLogCallArgs.Value())
-        {
-            /* ===================================================================================== */
-            /* Code to instrument the events at the end of a BBL (execution transfer)                */
-            /* Checking for calls, etc.                                                              */
-            /* ===================================================================================== */
-            INS tail = BBL_InsTail(bbl);
-
-            if(INS_IsCall(tail))
-            {
-                if(INS_IsDirectControlFlow(tail))
-                {
-                    const ADDRINT target = INS_DirectControlFlowTargetAddress(tail);
-
-                    INS_InsertPredicatedCall(
-                        tail,
-                        IPOINT_BEFORE,
-                        AFUNPTR(LogCallAndArgs),            // Function to jump to
-                        IARG_ADDRINT,                       // "target"'s type
-                        target,                             // Who is called?
-                        IARG_FUNCARG_ENTRYPOINT_VALUE,      // Arg_0 value
-                        0,
-                        IARG_FUNCARG_ENTRYPOINT_VALUE,      // Arg_1 value
-                        1,
-                        IARG_FUNCARG_ENTRYPOINT_VALUE,      // Arg_2 value
-                        2,
-                        IARG_END
-                    );
-                }
-                else
-                {
-                    INS_InsertCall(
-                        tail,
-                        IPOINT_BEFORE,
-                        AFUNPTR(LogIndirectCallAndArgs),
-                        IARG_BRANCH_TARGET_ADDR,
-                        IARG_BRANCH_TAKEN,
-                        IARG_FUNCARG_ENTRYPOINT_VALUE,
-                        0,
-                        IARG_FUNCARG_ENTRYPOINT_VALUE,
-                        1,
-                        IARG_FUNCARG_ENTRYPOINT_VALUE,
-                        2,
-                        IARG_END
-                    );
-                }
-            }
-            else
-            {
-                /* Other forms of execution transfer */
-                RTN rtn = TRACE_Rtn(trace);
-                // Trace jmp into DLLs (.idata section that is, imports)
-                if(RTN_Valid(rtn) && SEC_Name(RTN_Sec(rtn)) == ".idata")
-                {
-                    INS_InsertCall(
-                        tail,
-                        IPOINT_BEFORE,
-                        AFUNPTR(LogIndirectCallAndArgs),
-                        IARG_BRANCH_TARGET_ADDR,
-                        IARG_BRANCH_TAKEN,
-                        IARG_FUNCARG_ENTRYPOINT_VALUE,
-                        0,
-                        IARG_FUNCARG_ENTRYPOINT_VALUE,
-                        1,
-                        IARG_FUNCARG_ENTRYPOINT_VALUE,
-                        2,
-                        IARG_END
-                    );
-                }
-            }
-        }
-        /* Instrument at basic block level? */
-        if(KnobLogBB.Value())
+            bbl_level = false;
+        bool capped = bbl_level && budget != 0 && !coverage && InstrumentBudget(bbl);
+        if(bbl_level && !capped)
+            InstrumentBbl(trace, bbl);
+        if(KnobProfile.Value())
+            InstrumentShadowStack(bbl, bbl_level && !capped);
+        for(INS ins = head; INS_Valid(ins); ins = INS_Next(ins))
         {
-            /* instrument BBL_InsHead to write "loc_XXXXX", like in IDA Pro */
-            INS_InsertCall(head, IPOINT_BEFORE, AFUNPTR(LogBasicBlock), IARG_ADDRINT, BBL_Address(bbl), IARG_UINT32, BBL_Size(bbl), IARG_END);
+            if (INS_Address(ins) == end_addr)
+                INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)EndTracing, IARG_CALL_ORDER, CALL_ORDER_FIRST, IARG_END);
+            InstrumentIns(ins, version, capped);
         }
     }
 }
@@ -857,64 +2792,180 @@ void Trace_cb(TRACE trace, void *v)
 /* ================================================================================= */
 void ThreadStart_cb(THREADID threadIndex, CONTEXT *ctxt, INT32 flags, VOID *v)
 {
-    if(fileExists()) return;
+    ThreadLog *tl = new ThreadLog;
+    tl->tid = threadIndex;
+    tl->uid = PIN_ThreadUid();
+    tl->chunk = 0;
+    tl->InfoType = T;
+    tl->counter = 0;
+    tl->currentbbl = 0;
+    tl->WriteAddr = 0;
+    tl->WriteSize = 0;
+    tl->pending = NULL;
+    tl->exec_id = 0;
+    tl->executed = 0;
+    tl->in_alloc = false;
+    PIN_SetThreadData(tls_key, tl, threadIndex);
     PIN_GetLock(&lock, threadIndex + 1);
-    if (InfoType >= T) bigcounter++;
-    InfoType=T;
+    thread_logs.push_back(tl);
+    PIN_ReleaseLock(&lock);
+    // the stack of a new thread starts at its initial stack pointer
+    if (filter_stack)
+        PIN_SetContextReg(ctxt, stack_top_reg, PIN_GetContextReg(ctxt, REG_STACK_PTR));
+
+    if(tracing_paused || tracing_over) return;
+    NextStep(tl, T);
     switch (LogType) {
         case HUMAN:
-            TraceFile << "[T]" << setw(10) << dec << bigcounter << hex << " Thread 0x" << PIN_ThreadUid() << " started. Flags: 0x" << hex << flags << endl;
+            tl->out << "[T]" << setw(10) << dec << tl->counter << hex << " Thread 0x" << tl->uid << " started. Flags: 0x" << hex << flags << endl;
             break;
         case SQLITE:
-            sqlite3_reset(thread_insert);
-            sqlite3_bind_int64(thread_insert, 1, PIN_ThreadUid());
-            sqlite3_bind_int64(thread_insert, 2, currentbbl);
-            if(sqlite3_step(thread_insert) != SQLITE_DONE)
-                printf("THREAD error: %s\n", sqlite3_errmsg(db));
+        {
+            UINT64 pos;
+            SqlRecord *rec = SqlReserve(SQL_THREAD_START, tl->uid, &pos);
+            rec->addr = tl->counter;
+            SqlPublish(rec, pos);
+            break;
+        }
+        case BINARY:
+            WriteThreadMsg(tl->out, tl->counter, tl->uid, THREAD_CREATE);
             break;
     }
-    PIN_ReleaseLock(&lock);
 }
 
 
 void ThreadFinish_cb(THREADID threadIndex, const CONTEXT *ctxt, INT32 code, VOID *v)
 {
-    if(fileExists()) return;
+    ThreadLog *tl = GetThreadLog(threadIndex);
+    if (tl == NULL)
+        return;
+    FlushPendingExec(tl);
+    if(! tracing_paused && ! tracing_over) {
+        switch (LogType) {
+            case HUMAN:
+                tl->out << "[T]" << setw(10) << dec << tl->counter << hex << " Thread 0x" << tl->uid << " finished. Code: " << dec << code << endl;
+                break;
+            case SQLITE:
+            {
+                UINT64 pos;
+                SqlRecord *rec = SqlReserve(SQL_THREAD_EXIT, tl->uid, &pos);
+                rec->addr = tl->currentbbl;
+                SqlPublish(rec, pos);
+                break;
+            }
+            case BINARY:
+                WriteThreadMsg(tl->out, tl->counter, tl->uid, THREAD_EXIT);
+                break;
+        }
+    }
+    FlushThreadLog(tl);
+    MergeProfile(tl);
     PIN_GetLock(&lock, threadIndex + 1);
-    switch (LogType) {
-        case HUMAN:
-            TraceFile << "[T]" << setw(10) << dec << bigcounter << hex << " Thread 0x" << PIN_ThreadUid() << " finished. Code: " << dec << code << endl;
-            break;
-        case SQLITE:
-            sqlite3_reset(thread_update);
-            sqlite3_bind_int64(thread_update, 1, currentbbl);
-            sqlite3_bind_int64(thread_update, 2, PIN_ThreadUid());
-            if(sqlite3_step(thread_update) != SQLITE_DONE)
-                printf("THREAD error: %s\n", sqlite3_errmsg(db));
+    for (std::vector<ThreadLog*>::iterator it = thread_logs.begin(); it != thread_logs.end(); ++it)
+    {
+        if (*it == tl)
+        {
+            thread_logs.erase(it);
             break;
+        }
+    }
+    PIN_ReleaseLock(&lock);
+    PIN_SetThreadData(tls_key, NULL, threadIndex);
+    delete tl;
+}
+
+/* ===================================================================== */
+/* Fork                                                                  */
+/* ===================================================================== */
+
+// The child gets a copy of everything not written yet. The forking thread
+// writes its log and the trace file buffer first, the other threads keep
+// theirs in the parent, which writes them: the child drops their logs.
+// With sqlite, only the parent logs (see SqlForkChild).
+// The lock is held across the fork so that the child doesn't inherit it
+// taken by a thread it doesn't have.
+VOID ForkBefore_cb(THREADID tid, const CONTEXT *ctxt, VOID *v)
+{
+    ThreadLog *tl = GetThreadLog(tid);
+    if (tl != NULL)
+    {
+        FlushPendingExec(tl);
+        FlushThreadLog(tl);
     }
+    PIN_GetLock(&lock, tid + 1);
+    TraceFile.flush();
+}
+
+VOID ForkParent_cb(THREADID tid, const CONTEXT *ctxt, VOID *v)
+{
     PIN_ReleaseLock(&lock);
 }
 
+VOID ForkChild_cb(THREADID tid, const CONTEXT *ctxt, VOID *v)
+{
+    ThreadLog *tl = GetThreadLog(tid);
+    PIN_InitLock(&lock);
+    for (std::vector<ThreadLog*>::iterator it = thread_logs.begin(); it != thread_logs.end(); ++it)
+        if (*it != tl)
+            delete *it;
+    thread_logs.clear();
+    if (tl != NULL)
+        thread_logs.push_back(tl);
+    if (LogType == SQLITE)
+        SqlForkChild();
+}
+
 /* ===================================================================== */
 /* Fini                                                                  */
 /* ===================================================================== */
 
+// Internal threads must be gone before Fini
+static VOID PrepareForFini_cb(VOID *v)
+{
+    control_stop = true;
+    if (control_running)
+        PIN_WaitForThreadTermination(control_uid, PIN_INFINITE_TIMEOUT, NULL);
+    if (LogType == SQLITE)
+        SqlStopWriter();
+}
+
 VOID Fini(INT32 code, VOID *v)
 {
-    //if(fileExists()) return;
     switch (LogType) {
         case HUMAN:
+        case BINARY:
+            // Threads still alive at exit don't always get their fini callback
+            for (std::vector<ThreadLog*>::iterator it = thread_logs.begin(); it != thread_logs.end(); ++it)
+            {
+                FlushPendingExec(*it);
+                FlushThreadLog(*it);
+                MergeProfile(*it);
+            }
+            WriteProfile();
+            WriteCoverage();
             TraceFile.close();
+            if (ring_mode && ring_dumps == 0 && ! KnobQuiet.Value())
+                cerr << "[*] No trigger fired, the ring was not dumped" << endl;
             break;
         case SQLITE:
+            // The database is the parent's
+            if (sql_forked)
+                break;
+            // The writer is gone, insert what is left
+            SqlDrain();
+            for (std::vector<ThreadLog*>::iterator it = thread_logs.begin(); it != thread_logs.end(); ++it)
+                MergeProfile(*it);
+            WriteProfile();
+            WriteCoverage();
             sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL);
             sqlite3_finalize(info_insert);
             sqlite3_finalize(lib_insert);
             sqlite3_finalize(bbl_insert);
+            sqlite3_finalize(code_insert);
             sqlite3_finalize(ins_insert);
             sqlite3_finalize(mem_insert);
             sqlite3_finalize(call_insert);
+            sqlite3_finalize(ret_insert);
             sqlite3_finalize(thread_insert);
             sqlite3_finalize(thread_update);
             if(sqlite3_close(db) != SQLITE_OK)
@@ -925,6 +2976,13 @@ VOID Fini(INT32 code, VOID *v)
     }
 }
 
+// -D: the program goes on without PIN, Fini won't be called
+static VOID Detach_cb(VOID *v)
+{
+    PrepareForFini_cb(v);
+    Fini(0, v);
+}
+
 /* ===================================================================== */
 /* Main                                                                  */
 /* ===================================================================== */
@@ -938,6 +2996,9 @@ int  main(int argc, char *argv[])
     {
         return Usage();
     }
+    PIN_InitLock(&lock);
+    InitHexLut();
+    tls_key = PIN_CreateThreadDataKey(NULL);
 
     char *endptr;
     const char *tmpfilter = KnobLogFilter.Value().c_str();
@@ -951,25 +3012,48 @@ int  main(int argc, char *argv[])
         return 1;
     }
     if (logfilter > 2 && logfilter != 4) {
-        filter_begin=logfilter;
         logfilter = 3;
-        char *endptr2;
-        if (endptr[0] != '-') {
+        if (! ParseRanges(tmpfilter, filter_ranges)) {
             cerr << "ERR: Failed parsing option -f" <<endl;
             return 1;
         }
-        filter_end=strtoull(endptr+1, &endptr2, 16);
-        if (endptr2 == endptr+1) {
-            cerr << "ERR: Failed parsing option -f" <<endl;
+        RebuildFilterIndex();
+    }
+    ff_left = KnobSkip.Value();
+    fast_forward = (ff_left > 0);
+    const char *tmpend = KnobEnd.Value().c_str();
+    end_addr = strtoull(tmpend, &endptr, 16);
+    if (endptr == tmpend || endptr[0] != '\0') {
+        cerr << "ERR: Failed parsing option -e" <<endl;
+        return 1;
+    }
+    if (! KnobMemFilter.Value().empty()) {
+        if (! ParseRanges(KnobMemFilter.Value().c_str(), mem_ranges)) {
+            cerr << "ERR: Failed parsing option -M" <<endl;
             return 1;
         }
-        if (endptr2[0] != '\0') {
-            cerr << "ERR: Failed parsing option -f" <<endl;
+        NormalizeRanges(mem_ranges);
+        mem_filter_lo = mem_ranges.front().begin;
+        mem_filter_hi = mem_ranges.back().end;
+    }
+    if (! KnobAllocFilter.Value().empty()) {
+        if (! ParseAllocFilter(KnobAllocFilter.Value().c_str())) {
+            cerr << "ERR: Failed parsing option -A" <<endl;
             return 1;
         }
-        if (filter_end <= filter_begin) {
-            cerr << "ERR: Failed parsing option -f" <<endl;
-            return 1;
+        alloc_filter = true;
+        PIN_RWMutexInit(&alloc_mutex);
+    }
+    filter_stack = KnobStackFilter.Value();
+    budget = KnobBudget.Value();
+    budget_every = KnobBudgetEvery.Value();
+    if (filter_stack)
+    {
+        stack_top_reg = PIN_ClaimToolRegister();
+        if (!REG_valid(stack_top_reg))
+        {
+            cerr << "[!] No tool register left for the stack filter" << endl;
+            return -1;
         }
     }
     const char *tmpfilterlive = KnobLogFilterLive.Value().c_str();
@@ -1001,6 +3085,15 @@ int  main(int argc, char *argv[])
         }
     }
     filter_live_n = KnobLogFilterLiveN.Value();
+    if (logfilterlive)
+    {
+        live_reg = PIN_ClaimToolRegister();
+        if (!REG_valid(live_reg))
+        {
+            cerr << "[!] No tool register left for the live filter" << endl;
+            return -1;
+        }
+    }
 
     TraceName = KnobOutputFile.Value();
 
@@ -1014,9 +3107,42 @@ int  main(int argc, char *argv[])
         if (TraceName.compare("trace-full-info.txt") == 0)
             TraceName = "trace-full-info.sqlite";
     }
+    else if (KnobLogType.Value().compare("binary") == 0)
+    {
+        LogType = BINARY;
+        if (TraceName.compare("trace-full-info.txt") == 0)
+            TraceName = "trace-full-info.trace";
+    }
+    else if (KnobLogType.Value().compare("ring") == 0)
+    {
+        // binary records, kept in memory
+        LogType = BINARY;
+        ring_mode = true;
+        ring_chunks = std::max((UINT64)1, ((UINT64)KnobRingSize.Value() << 20) / THREAD_BUFFER_SIZE);
+        if (TraceName.compare("trace-full-info.txt") == 0)
+            TraceName = "trace-full-info.trace";
+    }
+    if (KnobProfile.Value() && LogType == BINARY)
+    {
+        cerr << "ERR: -p is not available with -t binary or -t ring" << endl;
+        return 1;
+    }
+    if (KnobCoverage.Value() && LogType == BINARY)
+    {
+        cerr << "ERR: -v is not available with -t binary or -t ring" << endl;
+        return 1;
+    }
+    coverage = KnobCoverage.Value();
+    SelectAnalysisFuns();
     switch (LogType) {
         case HUMAN:
-            TraceFile.open(TraceName.c_str());
+        case BINARY:
+            if (ring_mode)
+                break;
+            if (LogType == BINARY)
+                TraceFile.open(TraceName.c_str(), ios::out | ios::binary);
+            else
+                TraceFile.open(TraceName.c_str());
             if(TraceFile == NULL)
             {
                 cerr << "[!] Something went wrong opening the log file..." << endl;
@@ -1045,14 +3171,17 @@ int  main(int argc, char *argv[])
             }
             sqlite3_prepare_v2(db, "INSERT INTO info (key, value) VALUES (?, ?);", -1, &info_insert, NULL);
             sqlite3_prepare_v2(db, "INSERT INTO lib (name, base, end) VALUES (?, ?, ?);", -1, &lib_insert, NULL);
-            sqlite3_prepare_v2(db, "INSERT INTO bbl (addr, addr_end, size, thread_id) VALUES (?, ?, ?, ?);", -1, &bbl_insert, NULL);
-            sqlite3_prepare_v2(db, "INSERT INTO call (addr, name) VALUES (?, ?);", -1, &call_insert, NULL);
-            sqlite3_prepare_v2(db, "INSERT INTO ins (bbl_id, ip, dis, op) VALUES (?, ?, ?, ?);", -1, &ins_insert, NULL);
-            sqlite3_prepare_v2(db, "INSERT INTO mem (ins_id, ip, type, addr, addr_end, size, data, value) VALUES (?, ?, ?, ?, ?, ?, ?, ?);", -1, &mem_insert, NULL);
+            sqlite3_prepare_v2(db, "INSERT INTO bbl (addr, size, thread_id) VALUES (?, ?, ?);", -1, &bbl_insert, NULL);
+            sqlite3_prepare_v2(db, "INSERT INTO call (ins_id, addr, name) VALUES (?, ?, ?);", -1, &call_insert, NULL);
+            sqlite3_prepare_v2(db, "INSERT INTO ret (ins_id, addr) VALUES (?, ?);", -1, &ret_insert, NULL);
+            sqlite3_prepare_v2(db, "INSERT INTO code (ip, dis, op) VALUES (?, ?, ?);", -1, &code_insert, NULL);
+            sqlite3_prepare_v2(db, "INSERT INTO ins (bbl_id, code_id) VALUES (?, ?);", -1, &ins_insert, NULL);
+            sqlite3_prepare_v2(db, "INSERT INTO mem (ins_id, type, addr, size, data) VALUES (?, ?, ?, ?, ?);", -1, &mem_insert, NULL);
             sqlite3_prepare_v2(db, "INSERT INTO thread (thread_id, start_bbl_id) VALUES (?, ?);", -1, &thread_insert, NULL);
             sqlite3_prepare_v2(db, "UPDATE thread SET exit_bbl_id=? WHERE thread_id=?;", -1, &thread_update, NULL);
 
             sqlite3_exec(db, "BEGIN;", NULL, NULL, NULL);
+            SqlInitRing();
 
             break;
     }
@@ -1068,6 +3197,13 @@ int  main(int argc, char *argv[])
             TraceFile.unsetf(ios::showbase);
             break;
         case SQLITE:
+        {
+            sqlite3_reset(info_insert);
+            sqlite3_bind_text(info_insert, 1, "SCHEMA_VERSION", -1, SQLITE_TRANSIENT);
+            sqlite3_bind_text(info_insert, 2, SCHEMA_VERSION, -1, SQLITE_TRANSIENT);
+            if(sqlite3_step(info_insert) != SQLITE_DONE)
+                printf("INFO error: %s\n", sqlite3_errmsg(db));
+
             sqlite3_reset(info_insert);
             sqlite3_bind_text(info_insert, 1, "TRACERPIN_VERSION", -1, SQLITE_TRANSIENT);
             value.str("");
@@ -1114,14 +3250,76 @@ int  main(int argc, char *argv[])
             if(sqlite3_step(info_insert) != SQLITE_DONE)
                 printf("INFO error: %s\n", sqlite3_errmsg(db));
             break;
+        }
+        case BINARY:
+        {
+            value.str("");
+            value.clear();
+            value << GIT_DESC << " / PIN " << PIN_PRODUCT_VERSION_MAJOR << "." << PIN_PRODUCT_VERSION_MINOR << " build " << PIN_BUILD_NUMBER;
+            WriteInfoMsg(HeaderStream(), STR_TRACERPIN_VERSION, value.str());
+#if defined(TARGET_IA32E)
+            WriteInfoMsg(HeaderStream(), STR_ARCH, "AMD64");
+#else
+            WriteInfoMsg(HeaderStream(), STR_ARCH, "X86");
+#endif
+            value.str("");
+            value.clear();
+            int nArg=0;
+            for (; (nArg < argc) && std::string(argv[nArg]) != "--"; nArg++) {
+                if (nArg>0) value << " ";
+                value << argv[nArg];
+            }
+            WriteInfoMsg(HeaderStream(), "PINPROGRAM", value.str());
+            if (++nArg < argc)
+                WriteInfoMsg(HeaderStream(), STR_PROGRAM, argv[nArg++]);
+            value.str("");
+            value.clear();
+            int nArg_start=nArg;
+            for (; (nArg < argc); nArg++) {
+                if (nArg>nArg_start) value << " ";
+                value << argv[nArg];
+            }
+            WriteInfoMsg(HeaderStream(), STR_ARGS, value.str());
+            break;
+        }
+    }
+
+    if (LogType == SQLITE)
+    {
+        if (PIN_SpawnInternalThread(SqlWriterThread, NULL, 0, &sql_writer_uid) == INVALID_THREADID)
+        {
+            cerr << "[!] Could not start the sqlite writer thread" << endl;
+            return -1;
+        }
+    }
+    if (sharedVal != NULL)
+    {
+        tracing_paused = (get_lock() == 1);
+        if (PIN_SpawnInternalThread(ControlThread, NULL, 0, &control_uid) == INVALID_THREADID)
+        {
+            cerr << "[!] Could not start the tracing switch thread" << endl;
+            return -1;
+        }
+        control_running = true;
     }
+    PIN_AddPrepareForFiniFunction(PrepareForFini_cb, 0);
 
     IMG_AddInstrumentFunction(ImageLoad_cb, 0);
+    IMG_AddUnloadFunction(ImageUnload_cb, 0);
     PIN_AddThreadStartFunction(ThreadStart_cb, 0);
     PIN_AddThreadFiniFunction(ThreadFinish_cb, 0);
     TRACE_AddInstrumentFunction(Trace_cb, 0);
-    INS_AddInstrumentFunction(Instruction_cb, 0);
     PIN_AddFiniFunction(Fini, 0);
+    PIN_AddForkFunction(FPOINT_BEFORE, ForkBefore_cb, 0);
+    PIN_AddForkFunction(FPOINT_AFTER_IN_PARENT, ForkParent_cb, 0);
+    PIN_AddForkFunction(FPOINT_AFTER_IN_CHILD, ForkChild_cb, 0);
+    PIN_AddDetachFunction(Detach_cb, 0);
+    if (ring_mode)
+    {
+        PIN_AddContextChangeFunction(ContextChange_cb, 0);
+        PIN_InterceptSignal(SIGUSR2, RingSignal_cb, 0);
+        PIN_UnblockSignal(SIGUSR2, TRUE);
+    }
 
     // Never returns
 